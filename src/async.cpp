@@ -5,79 +5,119 @@
 // Using STL for now... But at least it's hidden.
 
 #include <vector>
-#include <queue>
+#include <deque>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 
 int maxThreads = int(std::thread::hardware_concurrency()); // Global.
 
+
+// Each worker owns a queue. The owner pushes and pops at the back (the newest
+// job is likely to touch what the current one has just touched), the others
+// steal from the front. Jobs sent from outside of the pool are spread round-robin.
+// The locks are per queue, so they are mostly uncontended.
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<Job*> jobs[Job::priorityCount];
+};
+
+
 // For now there is a single implicit thread pool.
-int producerCount = 0;
-std::vector<std::thread> workers;
-std::queue<Job*> pendingJobs;
-std::condition_variable signalPending;
-std::mutex mutex;
+struct Pool {
+    std::mutex mutex; // For starting, stopping and sleeping only.
+    std::condition_variable signalPending;
+    std::vector<std::thread> threads;
+    WorkQueue* queues = nullptr;
+    int queueCount = 0;
+    int producerCount = 0;
+    bool stopping = false;
+    std::atomic<bool> running{false};
+    std::atomic<int> pendingCount{0};
+    std::atomic<int> sleeperCount{0};
+    std::atomic<unsigned> nextQueue{0};
 
-void worker();
+    void start();
+    void stop();
+    void push(Job*);
+    Job* take(int self);
+    void execute(Job*);
+    void wake(bool all);
+    static void worker(int index);
+    static Batch::Impl* getImpl(Job* job) { return job->batch->impl; }
+};
+
+static Pool pool;
+static thread_local int workerIndex = -1; // -1 for threads outside of the pool.
 
 
 class Batch::Impl {
 public:
+    enum Waiting {
+        waitingNone,
+        waitingThread, // Receiver is not a pool worker, sleeps on own signal.
+        waitingWorker, // Pool worker, sleeps on pool signal, so it can be woken up to help.
+    };
     Impl(Batch* b): batch(b) {
-        std::unique_lock<std::mutex> lock(mutex);
-        producerCount++;
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        pool.producerCount++;
     }
     ~Impl() {
         discard();
-        std::unique_lock<std::mutex> lock(mutex);
+        // A worker may still be inside complete() of a job already received.
+        while (completingCount.load() > 0) {
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(pool.mutex);
         // Last work producer, stop worker threads.
-        if (--producerCount == 0) {
-            TRACE("Stopping %d threads", maxThreads);
-            // Null jobs signal exit to workers.
-            for (auto& worker: workers) {
-                pendingJobs.push(nullptr);
-                pendingJobs.push(nullptr);
-                signalPending.notify_all();
-            }
-            // Wait for them to finish.
+        if (--pool.producerCount == 0) {
             lock.unlock();
-            for (auto& worker: workers) {
-                worker.join();
-            }
-            // Free abandoned jobs.
-            lock.lock();
-            while (!pendingJobs.empty()) {
-                delete pendingJobs.front();
-                pendingJobs.pop();
-            }
-            workers.clear();
+            pool.stop();
         }
     }
     void send(Job* job) {
-        std::unique_lock<std::mutex> lock(mutex);
-        if (workers.empty()) {
+        if (!pool.running.load(std::memory_order_acquire)) {
             // Start lazily, on first request.
             // Stop when last work producer dies.
-            TRACE("Starting %d threads", maxThreads);
-            while (int(workers.size()) < maxThreads) {
-                workers.push_back(std::thread(worker));
-            }
+            pool.start();
         }
         job->batch = batch;
-        pendingJobs.push(job);
+        job->next = nullptr;
         sentCount++;
-        signalPending.notify_one();
+        pool.push(job);
     }
     Job* receive() {
-        std::unique_lock<std::mutex> lock(mutex);
         if (sentCount == receivedCount) {
             return nullptr;
         }
-        signalPendingne.wait(lock, [this]{return !doneJobs.empty();});
+        while (!doneList && !grabDone()) {
+            if (workerIndex >= 0) {
+                // We are inside some job. Don't just park the thread.
+                if (Job* job = pool.take(workerIndex)) {
+                    pool.execute(job);
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(pool.mutex);
+                waiting.store(waitingWorker);
+                pool.sleeperCount++;
+                pool.signalPending.wait(lock, [this]{
+                    return pool.pendingCount.load() > 0 || doneStack.load() != nullptr;
+                });
+                pool.sleeperCount--;
+                waiting.store(waitingNone);
+            }
+            else {
+                std::unique_lock<std::mutex> lock(waitMutex);
+                waiting.store(waitingThread);
+                signalDone.wait(lock, [this]{ return doneStack.load() != nullptr; });
+                waiting.store(waitingNone);
+            }
+        }
         receivedCount++;
-        Job* job = doneJobs.front();
-        doneJobs.pop();
+        Job* job = doneList;
+        doneList = job->next;
+        job->next = nullptr;
         return job;
     }
     void discard() {
@@ -85,40 +125,218 @@ public:
             delete job;
         }
     }
+    void cancel() {
+        if (!pool.running.load(std::memory_order_acquire)) {
+            return;
+        }
+        std::vector<Job*> dropped;
+        for (int i = 0; i < pool.queueCount; i++) {
+            WorkQueue& queue = pool.queues[i];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            for (auto& jobs: queue.jobs) {
+                for (auto j = jobs.begin(); j != jobs.end(); ) {
+                    if ((*j)->batch == batch) {
+                        dropped.push_back(*j);
+                        j = jobs.erase(j);
+                    }
+                    else {
+                        ++j;
+                    }
+                }
+            }
+        }
+        pool.pendingCount -= int(dropped.size());
+        sentCount -= int(dropped.size());
+        for (Job* job: dropped) {
+            delete job;
+        }
+    }
+    // Called by workers. Lock-free, except when the receiver sleeps.
+    // Once the job is published, the receiver may take it and destroy the batch,
+    // so the count keeps the Impl alive until the worker is done with it.
+    void complete(Job* job) {
+        completingCount++;
+        Job* head = doneStack.load(std::memory_order_relaxed);
+        do {
+            job->next = head;
+        } while (!doneStack.compare_exchange_weak(head, job));
+        switch (waiting.load()) {
+            case waitingThread: {
+                std::lock_guard<std::mutex> lock(waitMutex);
+                signalDone.notify_one();
+                break;
+            }
+            case waitingWorker:
+                pool.wake(true);
+                break;
+        }
+        completingCount--; // Last access.
+    }
+    // Move finished jobs to the private list, in order of completion.
+    bool grabDone() {
+        Job* stack = doneStack.exchange(nullptr);
+        while (stack) {
+            Job* next = stack->next;
+            stack->next = doneList;
+            doneList = stack;
+            stack = next;
+        }
+        return doneList != nullptr;
+    }
     Batch* batch = nullptr;
     int sentCount = 0;
     int receivedCount = 0;
-    std::queue<Job*> doneJobs;
-    std::condition_variable signalPendingne;
+    Job* doneList = nullptr; // Receiver's only.
+    std::atomic<Job*> doneStack{nullptr};
+    std::atomic<int> waiting{waitingNone};
+    std::atomic<int> completingCount{0};
+    std::mutex waitMutex;
+    std::condition_variable signalDone;
 };
 
 
-Batch::Batch(): impl(new Batch::Impl(this)) {}
+// Created on first send. Many batches never send anything (like those of unit
+// builders, only the top level one does).
+Batch::Batch(): impl(nullptr) {}
 Batch::~Batch() { delete impl; }
-void Batch::send(Job* job) { impl->send(job); }
-Job* Batch::receive() { return impl->receive(); }
-void Batch::discard() { return impl->discard(); }
+void Batch::send(Job* job) {
+    if (!impl) {
+        impl = new Batch::Impl(this);
+    }
+    impl->send(job);
+}
+Job* Batch::receive() { return impl ? impl->receive() : nullptr; }
+void Batch::discard() { if (impl) impl->discard(); }
+void Batch::cancel() { if (impl) impl->cancel(); }
 
 
-void worker() {
+void Pool::start() {
     std::unique_lock<std::mutex> lock(mutex);
-    for (;;) {
-        signalPending.wait(lock, []{return !pendingJobs.empty();});
-        Job* job = pendingJobs.front();
-        if (!job) {
-            break;
+    if (running.load()) {
+        return;
+    }
+    int n = maxThreads > 0 ? maxThreads : 1;
+    TRACE("Starting %d threads", n);
+    queueCount = n;
+    queues = new WorkQueue[n];
+    for (int i = 0; i < n; i++) {
+        threads.push_back(std::thread(worker, i));
+    }
+    running.store(true, std::memory_order_release);
+}
+
+
+void Pool::stop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!running.load()) {
+        return;
+    }
+    TRACE("Stopping %d threads", queueCount);
+    stopping = true;
+    signalPending.notify_all();
+    // Wait for them to finish.
+    lock.unlock();
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    lock.lock();
+    // Free abandoned jobs.
+    for (int i = 0; i < queueCount; i++) {
+        for (auto& jobs: queues[i].jobs) {
+            for (Job* job: jobs) {
+                delete job;
+            }
         }
-        pendingJobs.pop();
+    }
+    delete[] queues;
+    queues = nullptr;
+    queueCount = 0;
+    threads.clear();
+    pendingCount.store(0);
+    stopping = false;
+    running.store(false);
+}
 
-        lock.unlock();
-        job->run();
-        lock.lock();
 
-        Batch::Impl* receiver = job->batch->impl;
-        receiver->doneJobs.push(job);
-        receiver->signalPendingne.notify_one();
+void Pool::push(Job* job) {
+    int index = workerIndex >= 0 ? workerIndex : int(nextQueue++ % unsigned(queueCount));
+    WorkQueue& queue = queues[index];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs[job->priority].push_back(job);
+    }
+    pendingCount++;
+    if (sleeperCount.load() > 0) {
+        wake(false);
     }
 }
 
 
+Job* Pool::take(int self) {
+    if (pendingCount.load() <= 0) {
+        return nullptr;
+    }
+    for (int p = Job::priorityCount - 1; p >= 0; p--) {
+        if (self >= 0) {
+            WorkQueue& queue = queues[self];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.jobs[p].empty()) {
+                Job* job = queue.jobs[p].back();
+                queue.jobs[p].pop_back();
+                pendingCount--;
+                return job;
+            }
+        }
+        for (int i = 1; i <= queueCount; i++) {
+            int victim = (self + i) % queueCount;
+            if (victim == self) {
+                continue;
+            }
+            WorkQueue& queue = queues[victim];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.jobs[p].empty()) {
+                Job* job = queue.jobs[p].front();
+                queue.jobs[p].pop_front();
+                pendingCount--;
+                return job;
+            }
+        }
+    }
+    return nullptr;
+}
 
+
+void Pool::execute(Job* job) {
+    job->run();
+    getImpl(job)->complete(job);
+}
+
+
+void Pool::wake(bool all) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (all) {
+        signalPending.notify_all();
+    }
+    else {
+        signalPending.notify_one();
+    }
+}
+
+
+void Pool::worker(int index) {
+    workerIndex = index;
+    for (;;) {
+        if (Job* job = pool.take(index)) {
+            pool.execute(job);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        if (pool.stopping) {
+            break;
+        }
+        pool.sleeperCount++;
+        pool.signalPending.wait(lock, []{ return pool.pendingCount.load() > 0 || pool.stopping; });
+        pool.sleeperCount--;
+    }
+    workerIndex = -1;
+}
@@ -7,7 +7,14 @@ class Batch;
 // Something to execute asynchronously.
 class Job {
 public:
+    enum Priority {
+        priorityNormal,
+        priorityHigh,
+        priorityCount
+    };
     Batch* batch = nullptr; // For internal use.
+    Job* next = nullptr; // For internal use.
+    Priority priority = priorityNormal; // High priority jobs are picked first.
     Job() {}
     virtual ~Job() {}
     virtual void run() {}
@@ -16,7 +23,8 @@ public:
 
 // Work producer. Submit work items, receive back when done some time later.
 // Receive() returns null when all submitted work is done, otherwise
-// it blocks until one item is done.
+// it blocks until one item is done. If it is called by a worker thread
+// (from inside some Job::run()), the thread runs pending jobs while waiting.
 class Batch {
 public:
     Batch();
@@ -28,9 +36,10 @@ public:
     Job* receive(); /*delete*/
 
     void discard(); // Wait for jobs, delete them.
+    void cancel(); // Delete jobs not started yet. The running ones are still to be received.
 
 private:
-    friend void worker();
+    friend struct Pool;
     class Impl;
     Impl* impl;
 };
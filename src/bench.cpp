@@ -0,0 +1,166 @@
+#include "bench.h"
+#include "history.h"
+#include "output.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+// Statistics only, STL is hidden here.
+#include <vector>
+#include <algorithm>
+
+
+struct FileHeader {
+    static constexpr uint32_t currentMagic = 0x42584321; // "!CXB"
+    uint32_t magic;
+    uint32_t count;
+};
+
+
+struct Summary {
+    int64_t min = 0;
+    int64_t median = 0;
+    double mean = 0;
+    double stddev = 0;
+};
+
+
+static Summary summarize(std::vector<int64_t> values) {
+    Summary s;
+    if (values.empty()) {
+        return s;
+    }
+    std::sort(values.begin(), values.end());
+    int n = values.size();
+    s.min = values[0];
+    s.median = n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+    double sum = 0;
+    for (int64_t v: values) {
+        sum += v;
+    }
+    s.mean = sum / n;
+    double squares = 0;
+    for (int64_t v: values) {
+        squares += (v - s.mean) * (v - s.mean);
+    }
+    s.stddev = n > 1 ? sqrt(squares / (n - 1)) : 0;
+    return s;
+}
+
+
+void BenchResults::add(int64_t wall, int64_t cpu) {
+    Sample sample = {wall, cpu};
+    samples.add(&sample, sizeof(sample));
+}
+
+
+bool BenchResults::load(const char* path) {
+    Blob blob;
+    if (!blob.load(path) || blob.size < int(sizeof(FileHeader))) {
+        return false;
+    }
+    const FileHeader* header = (const FileHeader*)blob.data;
+    int size = header->count * sizeof(Sample);
+    if (header->magic != FileHeader::currentMagic || blob.size != int(sizeof(FileHeader)) + size) {
+        return false;
+    }
+    samples.clear();
+    samples.add(blob.data + sizeof(FileHeader), size);
+    return true;
+}
+
+
+bool BenchResults::save(const char* path) {
+    FileHeader header = {FileHeader::currentMagic, uint32_t(getCount())};
+    Blob blob;
+    blob.add(&header, sizeof(header));
+    blob.add(samples.data, samples.size);
+    return blob.save(path);
+}
+
+
+void BenchResults::print() const {
+    std::vector<int64_t> wall;
+    std::vector<int64_t> cpu;
+    for (int i = 0; i < getCount(); i++) {
+        wall.push_back(get(i)->wall);
+        cpu.push_back(get(i)->cpu);
+    }
+    INFO("  %-6s %10s %10s %10s %10s", "", "min", "median", "mean", "stddev");
+    const char* names[2] = {"wall", "cpu"};
+    Summary summaries[2] = {summarize(wall), summarize(cpu)};
+    for (int i = 0; i < 2; i++) {
+        const Summary& s = summaries[i];
+        char min[32], median[32], mean[32], stddev[32];
+        INFO("  %-6s %10s %10s %10s %10s", names[i], formatDuration(s.min, min), formatDuration(s.median, median),
+            formatDuration(int64_t(s.mean), mean), formatDuration(int64_t(s.stddev), stddev));
+    }
+}
+
+
+void BenchResults::compare(const BenchResults& base, const char* baseName) const {
+    std::vector<int64_t> wall;
+    std::vector<int64_t> baseWall;
+    for (int i = 0; i < getCount(); i++) {
+        wall.push_back(get(i)->wall);
+    }
+    for (int i = 0; i < base.getCount(); i++) {
+        baseWall.push_back(base.get(i)->wall);
+    }
+    if (wall.empty() || baseWall.empty()) {
+        return;
+    }
+    int64_t before = summarize(baseWall).median;
+    int64_t after = summarize(wall).median;
+    double p = getPValue(wall.data(), wall.size(), baseWall.data(), baseWall.size());
+    char beforeText[32];
+    char afterText[32];
+    INFO("Against %s: median wall time %s -> %s (%+.1f%%), %s (p=%.3f)", baseName,
+        formatDuration(before, beforeText), formatDuration(after, afterText), before ? (double(after) / before - 1) * 100 : 0.0,
+        p < 0.05 ? (after < before ? "faster" : "slower") : "no significant difference", p);
+}
+
+
+double BenchResults::getPValue(const int64_t* a, int aCount, const int64_t* b, int bCount) {
+    if (aCount == 0 || bCount == 0) {
+        return 1;
+    }
+    std::vector<std::pair<int64_t, int>> all; // Value, sample.
+    for (int i = 0; i < aCount; i++) {
+        all.push_back(std::make_pair(a[i], 0));
+    }
+    for (int i = 0; i < bCount; i++) {
+        all.push_back(std::make_pair(b[i], 1));
+    }
+    std::sort(all.begin(), all.end());
+    int n = all.size();
+    double aRanks = 0;
+    double ties = 0; // Sum of t^3 - t over groups of equal values.
+    for (int i = 0; i < n; ) {
+        int j = i;
+        while (j < n && all[j].first == all[i].first) {
+            j++;
+        }
+        double rank = (i + 1 + j) / 2.0; // Average of ranks i+1..j.
+        for (int k = i; k < j; k++) {
+            if (all[k].second == 0) {
+                aRanks += rank;
+            }
+        }
+        double t = j - i;
+        ties += t * t * t - t;
+        i = j;
+    }
+    double u = aRanks - aCount * (aCount + 1) / 2.0;
+    double mean = aCount * double(bCount) / 2;
+    double variance = aCount * double(bCount) / 12 * ((n + 1) - ties / (double(n) * (n - 1)));
+    if (variance <= 0) {
+        return 1;
+    }
+    double distance = fabs(u - mean) - 0.5; // Continuity correction.
+    if (distance <= 0) {
+        return 1;
+    }
+    return erfc(distance / sqrt(variance) / sqrt(2.0));
+}
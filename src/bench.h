@@ -0,0 +1,39 @@
+#pragma once
+
+#include "blob.h"
+#include <cstdint>
+
+struct BenchOptions {
+    int runs = 10;
+    int warmup = 1; // Runs not measured.
+    int cpu = -1; // Pin to this CPU, if not negative.
+    bool noAslr = false; // Disable address space layout randomization.
+    const char* baseline = nullptr; // Compare with it, instead of the previous results.
+    const char* saveBaseline = nullptr; // Save results under this name, too.
+    double maxIncrease = -1; // Percent of instructions, see Builder::count(). No limit if negative.
+};
+
+// Wall and CPU times of runs of a benchmarked program. Stored in the cache,
+// next to the program, to compare with later.
+class BenchResults {
+public:
+    void add(int64_t wall, int64_t cpu); // Nanoseconds.
+    int getCount() const { return samples.size / int(sizeof(Sample)); }
+    bool load(const char* path);
+    bool save(const char* path);
+    void print() const;
+    // Difference of median wall time, and whether it's significant.
+    void compare(const BenchResults& base, const char* baseName) const;
+
+    // Two-sided p-value of Mann-Whitney U test (normal approximation, with
+    // ties), for the hypothesis that both samples come from one distribution.
+    static double getPValue(const int64_t* a, int aCount, const int64_t* b, int bCount);
+
+private:
+    struct Sample {
+        int64_t wall;
+        int64_t cpu;
+    };
+    Blob samples;
+    const Sample* get(int i) const { return (const Sample*)samples.data + i; }
+};
@@ -1,34 +1,36 @@
 #include "blob.h"
+#include "dirs.h"
 
 #include <cstring>
+#include <cstdio>
+#include <atomic>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 
 
 Blob::Blob(int n): data(nullptr), size(0), allocated(0) {
-    data = new char[n];
-    allocated = n;
+    if (n > 0) {
+        data = new char[n];
+        allocated = n;
+    }
 }
 
 
+// Copies take only what's used. Most lists are small, and many are copied
+// (like unit configurations, from the common one).
 Blob::Blob(const Blob& other): data(nullptr), size(0), allocated(0) {
-    data = new char[other.allocated]; 
-    allocated = other.allocated;
-    size = other.size;
+    *this = other;
 }
 
 
 Blob& Blob::operator=(const Blob& other) {
-    if (allocated < other.allocated) {
-        delete[] data;
-        data = nullptr;
-        size = allocated = 0;
-        data = new char[other.allocated];
-        allocated = other.allocated;
+    if (this != &other) {
+        growTo(other.size, false);
+        if (other.size) {
+            memcpy(data, other.data, other.size);
+        }
     }
-    size = other.size;
-    memcpy(data, other.data, other.size);
     return *this;
 }
 
@@ -38,10 +40,10 @@ char* Blob::growTo(int n, bool retain) {
     if (allocated < n) {
         int newAlloc = allocated * 2;
         if (newAlloc < n) {
-            newAlloc = (n + 1023) & ~1023;
+            newAlloc = (n + 63) & ~63;
         }
         char* p = new char[newAlloc];
-        if (retain) {
+        if (retain && size) {
             memcpy(p, data, size);
         }
         delete[] data;
@@ -104,9 +106,14 @@ bool load(const char* path, void* data, int size) {
 }
 
 
+// Written to a temporary file, then renamed, so other processes reading it
+// (like another cx building the same tree) never see a partial file.
 bool save(const char* path, const void* data, int size) {
+    static std::atomic<int> counter(0);
+    char tempPath[maxPath + 32];
+    snprintf(tempPath, sizeof(tempPath), "%s.%d.%d.tmp", path, int(getpid()), counter++);
     bool ok = false;
-    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    int fd = open(tempPath, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666);
     if (fd >= 0) {
         while (size) {
             int n = write(fd, data, size);
@@ -117,7 +124,10 @@ bool save(const char* path, const void* data, int size) {
             data = (const char*)data + n;
         }
         close(fd);
-        ok = size == 0;
+        ok = size == 0 && rename(tempPath, path) == 0;
+        if (!ok) {
+            unlink(tempPath);
+        }
     }
     return ok;
 }
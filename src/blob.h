@@ -6,7 +6,7 @@ public:
     char* data;
     int size;
     int allocated;
-    Blob(int n = 1024);
+    Blob(int n = 0); // Nothing is allocated until needed.
     ~Blob() { delete[] data; }
     Blob(const Blob&);
     Blob& operator=(const Blob&);
@@ -5,63 +5,187 @@
 #include "blob.h"
 #include "runner.h"
 #include "async.h"
+#include "watcher.h"
+#include "cache.h"
+#include "timereport.h"
+#include "impact.h"
+#include "profiler.h"
+#include "hash.h"
 
 #include <cstring>
+#include <ctime>
+#include <fnmatch.h>
+#include <unistd.h>
 
 
 enum JobType {
+    jobTypeScan,
     jobTypeCompile,
-    jobTypeLibrary,
+    jobTypeArchive,
+    jobTypeLink,
+    jobTypeTest,
 };
 
 
+// Jobs never wait for other jobs. All of them are sent and received by the
+// top level builder, which decides what can go next (see Builder::onJobDone()).
+// So the build is a graph: scan unit, compile its sources (which may discover
+// more units), archive, and when all used units are done, link.
 struct BuilderJob: public Job {
-    bool ok;
+    Builder& builder; // Unit context.
     JobType type;
-    BuilderJob() {}
+    bool ok = false;
+    StringList errors; // Delayed errors, held if the unit is prefetched.
+    BuilderJob(Builder& b, JobType t): builder(b), type(t) {}
 };
 
 
-// Source checking/compilation in the context of parent unit builder.
+// Unit configuration loading and source finding.
+struct ScanJob: public BuilderJob {
+    ScanJob(Builder& b): BuilderJob(b, jobTypeScan) {}
+    void run() override {
+        ErrorCapture capture(builder.prefetched ? &errors : nullptr);
+        ok = builder.scanUnit();
+    }
+};
+
+
+// Source checking/compilation.
 struct CompileJob: public BuilderJob {
-    Builder& builder;
     const char* name;
     bool skipDepsCheck;
     bool recompiled;
     bool hasMain;
     Dependencies deps;
     CompileJob(Builder& b, const char* n, bool s):
-        builder(b),
+        BuilderJob(b, jobTypeCompile),
         name(n),
         skipDepsCheck(s)
-    {
-        type = jobTypeCompile;
-    }
+    {}
     void run() override {
+        ErrorCapture capture(builder.prefetched ? &errors : nullptr);
         ok = builder.updateSource(name, skipDepsCheck, recompiled, deps);
         hasMain = deps.getHeader().flags & Compiler::flagHasMain;
     }
 };
 
 
-// Library making (once compilation is done) in a new dedicated unit Builder.
-struct LibraryJob: public BuilderJob {
-    Builder builder;
-    LibraryJob() {
-        type = jobTypeLibrary;
+// Library making, once all unit sources are compiled.
+struct ArchiveJob: public BuilderJob {
+    ArchiveJob(Builder& b): BuilderJob(b, jobTypeArchive) {}
+    void run() override {
+        ErrorCapture capture(builder.prefetched ? &errors : nullptr);
+        ok = builder.updateLibrary();
+    }
+};
+
+
+// Linking of one program, once all units are done.
+struct LinkJob: public BuilderJob {
+    const char* objPath;
+    const StringList& libList;
+    uint64_t libsTag;
+    LinkJob(Builder& b, const char* o, const StringList& l, uint64_t t):
+        BuilderJob(b, jobTypeLink),
+        objPath(o),
+        libList(l),
+        libsTag(t)
+    {}
+    void run() override {
+        ok = builder.updateExecutable(objPath, libList, libsTag);
+    }
+};
+
+
+// Running one test program, output captured.
+struct TestJob: public BuilderJob {
+    char execPath[maxPath];
+    char sourcePath[maxPath];
+    Runner runner;
+    double seconds = 0;
+    TestJob(Builder& b, const char* e, const char* s): BuilderJob(b, jobTypeTest) {
+        strcpy(execPath, e);
+        strcpy(sourcePath, s);
     }
     void run() override {
-        ok = builder.buildPhase2();
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ok = builder.runTest(execPath, runner);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    }
+};
+
+
+static int64_t getMonotonicTime() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+
+// A target being rebuilt. While in scope, it counts for the progress estimate.
+// If done, its duration goes to build history.
+struct WorkScope {
+    Builder& master;
+    BuildHistory::TargetKind kind;
+    const char* target;
+    int64_t estimate;
+    int64_t start;
+    bool done = false;
+    WorkScope(Builder& m, BuildHistory::TargetKind k, const char* t): master(m), kind(k), target(t) {
+        {
+            std::lock_guard<std::mutex> lock(master.historyMutex);
+            master.loadHistory();
+            estimate = master.history.estimate(kind, target);
+        }
+        start = getMonotonicTime();
+        master.workEstimate += estimate;
+        master.workStartSum += start;
+        master.workCount++;
+    }
+    ~WorkScope() {
+        int64_t end = getMonotonicTime();
+        master.workCount--;
+        master.workStartSum -= start;
+        master.workEstimate -= estimate;
+        if (done) {
+            std::lock_guard<std::mutex> lock(master.historyMutex);
+            master.history.add(kind, target, end - start);
+        }
     }
 };
 
 
+Builder::Builder() {
+    topPath = new char[maxPath * 3];
+    sourceToRun = topPath + maxPath;
+    programPath = sourceToRun + maxPath;
+    topPath[0] = sourceToRun[0] = programPath[0] = 0;
+}
+
+
+Builder::Builder(Builder* m):
+    currentDirectory(m->currentDirectory),
+    profile(m->profile),
+    compiler(m->compiler),
+    master(m)
+{
+    options.force = m->options.force;
+}
+
+
 Builder::~Builder() {
     batch.discard();
     if (master == this) {
+        while (Builder* unit = units) {
+            units = unit->nextUnit;
+            delete unit;
+        }
         delete compiler;
         delete profile;
         delete currentDirectory;
+        delete[] topPath;
     }
 }
 
@@ -97,27 +221,65 @@ uint64_t Builder::lookupFileTag(const char* name) {
 }
 
 
-// Scan unit directory for sources to compile.
+void Builder::addScannedFile(FileType type, const Directory::Entry& entry) {
+    FileStateDict::Entry* p;
+    if (type == typeCSource || type == typeCppSource) {
+        sources.add(entry.tag, entry.name);
+    }
+    fileStateCache.add(entry.tag, entry.name, p);
+}
+
+
+// Scan unit directory for sources to compile. Only sources and headers are
+// stat'ed. Their names are cached (tags are file types), keyed by modification
+// time of the directory, so readdir is skipped if nothing was added or removed.
 bool Builder::scanDirectory() {
     sources.clear();
     fileStateCache.clear();
+    char listingPath[maxPath];
+    char absListingPath[maxPath];
+    makeDerivedPath(profile->id, unitPath, "listing", "", listingPath);
+    rebase(listingPath, absListingPath);
+    uint64_t dirTag = makeDirectoryTag(unitPath);
     Directory dir(unitPath);
-    for (Directory::Entry entry; dir.read(entry); ) {
-        FileStateDict::Entry* p;
-        FileType type = getFileType(entry.name);
-        if (type == typeCSource || type == typeCppSource) {
-            sources.add(entry.tag, entry.name);
-            fileStateCache.add(entry.tag, entry.name, p);
+    Dependencies listing;
+    if (dirTag && listing.load(absListingPath) && listing.getHeader().inputsTag == dirTag) {
+        bool ok = true;
+        for (Dependencies::Iterator i(listing); i && ok; i.next()) {
+            Directory::Entry entry;
+            entry.type = Directory::typeFile;
+            entry.name = i->string;
+            ok = dir.stat(entry);
+            addScannedFile(FileType(i->tag), entry);
         }
-        else if (type == typeHeader) {
-            fileStateCache.add(entry.tag, entry.name, p);
+        if (ok) {
+            return true;
+        }
+        sources.clear();
+        fileStateCache.clear();
+    }
+    listing.clear();
+    for (Directory::Entry entry; dir.read(entry, false); ) {
+        FileType type = getFileType(entry.name);
+        if (type == typeUnknown || entry.type == Directory::typeDirectory) {
+            continue;
         }
+        dir.stat(entry);
+        addScannedFile(type, entry);
+        listing.add(type, entry.name);
+    }
+    // If the directory was modified just now, it could be modified again within
+    // the same timestamp, so don't trust it (like Git's "racily clean" files).
+    // There is no cache directory before the first build, then it's not saved either.
+    if (dirTag && getCurrentTime() - int64_t(dirTag) > 1000000000) {
+        listing.getHeader().inputsTag = dirTag;
+        listing.save(absListingPath);
     }
     return true;
 }
 
 
-bool Builder::checkDeps(const char* targetPath, uint32_t toolTag, uint32_t optTag, Dependencies& deps) {
+bool Builder::checkDeps(const char* targetPath, uint64_t toolTag, uint64_t optTag, uint64_t inputsTag, Dependencies& deps) {
     char absTargetPath[maxPath];
     if (!fileExists(rebase(targetPath, absTargetPath))) {
         TRACE("File %s does not exist", absTargetPath);
@@ -139,6 +301,10 @@ bool Builder::checkDeps(const char* targetPath, uint32_t toolTag, uint32_t optTa
         TRACE("Options with which %s was created have changed", absDepsPath);
         return false;
     }
+    if (header.inputsTag != inputsTag) {
+        TRACE("Other inputs of %s have changed", absDepsPath);
+        return false;
+    }
     std::lock_guard<std::mutex> lock(fileStateCacheMutex);
     for (FileStateList::Iterator dep(deps); dep; dep.next()) {
         if (dep->tag != lookupFileTag(dep->string)) {
@@ -152,7 +318,7 @@ bool Builder::checkDeps(const char* targetPath, uint32_t toolTag, uint32_t optTa
 }
 
 
-bool Builder::checkDeps(const char* targetPath, uint32_t toolTag, uint32_t optTag, uint64_t inputsTag, uint8_t& flags) {
+bool Builder::checkDeps(const char* targetPath, uint64_t toolTag, uint64_t optTag, uint64_t inputsTag, uint8_t& flags) {
     char absTargetPath[maxPath];
     if (!fileExists(rebase(targetPath, absTargetPath))) {
         TRACE("File %s does not exist", absTargetPath);
@@ -184,11 +350,19 @@ bool Builder::checkDeps(const char* targetPath, uint32_t toolTag, uint32_t optTa
 }
 
 
+// Unit states (tags in unitDirDeps).
+enum {
+    unitFlagStarted = 1, // Phase 1 started.
+    unitFlagLibrary = 2, // Library is made and fresh.
+    unitFlagFailed = 4,  // Failed to build. Only matters if unit turns out to be used.
+};
+
+
 // We have just compiled one source (or made sure it's fresh).
 // Check its dependency list generated by the compiler (or loaded from previously saved dep file).
 // If this source introduces dependency on a new unit (i.e. another directory),
 // start building that, immediately.
-bool Builder::extractUnitDirDeps(Dependencies& deps) {
+void Builder::extractUnitDirDeps(Dependencies& deps) {
     for (Dependencies::Iterator i(deps); i; i.next()) {
         char dir[maxPath];
         char rebased[maxPath];
@@ -196,54 +370,175 @@ bool Builder::extractUnitDirDeps(Dependencies& deps) {
         normalizePath(rebase(getDirectory(i->string, dir), rebased), normalized);
         if (dir[0]) {
             std::unique_lock<std::mutex> lock(master->masterMutex);
+            if (strcmp(normalized, unitPath) != 0) {
+                char edge[maxPath * 2];
+                int fromLength = strlen(unitPath);
+                int toLength = strlen(normalized);
+                memcpy(edge, unitPath, fromLength + 1);
+                memcpy(edge + fromLength + 1, normalized, toLength);
+                StringDict::Entry* e;
+                master->unitEdges.add(edge, fromLength + 1 + toLength, e);
+            }
             FileStateDict::Entry* entry;
-            if (master->unitDirDeps.add(1, normalized, entry)) {
+            if (master->unitDirDeps.add(unitFlagStarted, normalized, entry)) {
                 // We have new unit dependency.
-                // Enqueue its sources for compilation/freshness checking ("phase 1").
-                // Start a library job, which will wait for those to finish, and make
-                // unit library in "phase 2".
                 lock.unlock();
-                LibraryJob* job = new LibraryJob();
-                job->builder.master = master;
-                job->builder.options.force = options.force;
-                if (!job->builder.buildPhase1(entry->string, nullptr)) {
-                    delete job;
-                    return false;
-                }
-                batch.send(job);
+                master->startUnit(normalized);
+            }
+        }
+    }
+}
+
+
+// Create a builder for a new unit, and start with loading its configuration
+// and scanning its directory. Top level builder only.
+void Builder::startUnit(const char* path, bool prefetched) {
+    Builder* unit = new Builder(this);
+    strcpy(unit->unitPath, path);
+    unit->prefetched = prefetched;
+    unit->nextUnit = units;
+    units = unit;
+    batch.send(new ScanJob(*unit));
+}
+
+
+void Builder::markUnit(const char* path, uint64_t flags) {
+    std::lock_guard<std::mutex> lock(master->masterMutex);
+    master->unitDirDeps.put(unitFlagStarted, path)->tag |= flags;
+}
+
+
+// Units reachable from the top one, according to what is known by now.
+// Units started speculatively (see prefetchUnits()) may be not among them.
+void Builder::collectUsedUnits(StringDict& used, const char* root) {
+    StringDict::Entry* e;
+    used.add(root ? root : master->unitPath, e);
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (StringDict::Iterator i(master->unitEdges); i; i.next()) {
+            int fromLength = strlen(i->string);
+            if (used.find(i->string, fromLength)) {
+                const char* to = i->string + fromLength + 1;
+                changed |= used.add(to, i->length - fromLength - 1, e);
             }
         }
     }
+}
+
+
+// Did any of the used units fail?
+bool Builder::checkUnitFailures(const char* root) {
+    std::lock_guard<std::mutex> lock(master->masterMutex);
+    StringDict used;
+    collectUsedUnits(used, root);
+    for (StringDict::Iterator i(used); i; i.next()) {
+        FileStateDict::Entry* entry = master->unitDirDeps.find(i->string, i->length);
+        if (entry && (entry->tag & unitFlagFailed)) {
+            return false;
+        }
+    }
     return true;
 }
 
 
+// Unit dependencies are discovered one level at a time, as sources get compiled.
+// Don't wait for that: start with the units used by the previous build.
+void Builder::prefetchUnits() {
+    char graphPath[maxPath];
+    char absGraphPath[maxPath];
+    makeDerivedPath(profile->id, unitPath, "units", "", graphPath);
+    StringList units;
+    if (!units.load(rebase(graphPath, absGraphPath))) {
+        return;
+    }
+    for (StringList::Iterator i(units); i; i.next()) {
+        if (!directoryExists(i->string)) {
+            continue;
+        }
+        FileStateDict::Entry* entry;
+        std::unique_lock<std::mutex> lock(masterMutex);
+        if (unitDirDeps.add(unitFlagStarted, i->string, i->length, entry)) {
+            lock.unlock();
+            TRACE("Prefetching %s", i->string);
+            startUnit(i->string, true);
+        }
+    }
+}
+
+
+// Errors of prefetched units are printed only if these units are used after all.
+void Builder::releaseHeldErrors(const StringDict& used) {
+    for (Builder* unit = units; unit; unit = unit->nextUnit) {
+        if (!unit->heldErrors.isEmpty()) {
+            if (used.find(unit->unitPath)) {
+                delayedError(unit->heldErrors);
+            }
+            else {
+                TRACE("Dropping errors of unused %s", unit->unitPath);
+            }
+            unit->heldErrors.clear();
+        }
+    }
+}
+
+
+void Builder::saveUnitGraph(const StringDict& used) {
+    StringList units;
+    for (StringDict::Iterator i(used); i; i.next()) {
+        if (strcmp(i->string, unitPath) != 0) {
+            units.add(i->string, i->length);
+        }
+    }
+    char graphPath[maxPath];
+    char absGraphPath[maxPath];
+    makeDerivedPath(profile->id, unitPath, "units", "", graphPath);
+    rebase(graphPath, absGraphPath);
+    StringList old;
+    if (old.load(absGraphPath) && old.getCount() == units.getCount() && getStringListHash(old) == getStringListHash(units)) {
+        return;
+    }
+    TRACE("Saving unit graph, %d units", units.getCount());
+    units.save(absGraphPath);
+}
+
+
 // Prepare lib list for the linker. Both discovered unit dependencies
-// and external libs collected recursively.
-void Builder::fillUnitLibList(StringList& libList) {
-    for (FileStateDict::Iterator i(unitDirDeps); i; i.next()) {
-        if (i->tag == 2) {
+// and external libs collected recursively. Returns combined tag of unit libraries.
+uint64_t Builder::fillUnitLibList(StringList& libList, const char* root) {
+    std::lock_guard<std::mutex> lock(masterMutex);
+    StringDict used;
+    collectUsedUnits(used, root);
+    uint64_t libsTag = 0;
+    for (StringDict::Iterator i(used); i; i.next()) {
+        FileStateDict::Entry* entry = unitDirDeps.find(i->string, i->length);
+        if (entry && (entry->tag & unitFlagLibrary)) {
             char libPath[maxPath];
-            makeDerivedPath(profile->id, i->string, "library", libPath);
+            makeDerivedPath(profile->id, unitPath, i->string, "library", libPath);
             TRACE("Depend on library %s", libPath);
             char absLibPath[maxPath];
             libList.add(rebasePath(currentDirectory, libPath, absLibPath));
+            libsTag += makeFileTag(absLibPath);
         }
     }
-    for (FileStateDict::Iterator i(libDeps); i; i.next()) {
-        libList.add(i->string, i->length);
+    StringDict libs;
+    for (StringDict::Iterator i(unitLibDeps); i; i.next()) {
+        int unitLength = strlen(i->string);
+        if (used.find(i->string, unitLength)) {
+            const char* lib = i->string + unitLength + 1;
+            int libLength = i->length - unitLength - 1;
+            StringDict::Entry* e;
+            if (libs.add(lib, libLength, e)) {
+                libList.add(lib, libLength);
+            }
+        }
     }
+    return libsTag;
 }
 
 
 bool Builder::processPath(const char* path) {
     unitPath[0] = 0;
     sourceToRun[0] = 0;
-    if (master != this) {
-        currentDirectory = master->currentDirectory;
-        strcpy(unitPath, path);
-        return true;
-    }
     if (!currentDirectory) {
         currentDirectory = new char[maxPath];
     }
@@ -287,96 +582,141 @@ bool Builder::processPath(const char* path) {
 
 
 bool Builder::clean(const char* path, const char* configId) {
-    char dir[maxPath];
-    if (fileExists(path)) {
-        path = getDirectory(path, dir);
-    }
-    if (!*path) {
-        path = ".";
-    }
-    if (!directoryExists(path)) {
-        FAILURE("Path %s does not exist, or is not a directory", path);
+    // Configuration id only matters for cx.top sections, which may set cache root.
+    if (!(processPath(path) && loadTopConfig(getConfigId(configId)))) {
         return false;
     }
-    Runner runner;
-    runner.args.add("find");
-    runner.args.add(path);
-    runner.args.add("-type");
-    runner.args.add("d");
+    CacheCleaner cleaner;
     if (!configId || !*configId) {
-        TRACE("Cleaning %s for all configurations", path);
-        runner.args.add("-name");
-        runner.args.add(cacheDirName);
+        TRACE("Cleaning %s for all configurations", unitPath);
     }
     else {
-        TRACE("Cleaning %s for configuration [%s]", path, configId);
-        runner.args.add("-wholename");
-        char name[maxPath];
-        runner.args.add(name, sprintf(name, "**/%s/%s", cacheDirName, configId));
+        TRACE("Cleaning %s for configuration [%s]", unitPath, configId);
+        cleaner.configId = configId;
+    }
+    bool ok = cleaner.clean(unitPath);
+    char size[32];
+    INFO("Deleted %d files, %s", cleaner.filesDeleted, formatSize(cleaner.bytesFreed, size));
+    return ok;
+}
+
+
+bool Builder::isObjectFresh(const char* sourcePath, const char* objPath, uint64_t profileTag, Dependencies& deps) {
+    if (!checkDeps(objPath, profile->tag, compiler->getCompilerOptionsTag(config, sourcePath), profileTag, deps)) {
+        return false;
     }
-    runner.args.add("-exec");
-    runner.args.add("rm");
-    runner.args.add("-rf");
-    runner.args.add("{}");
-    runner.args.add(";");
-    return runner.run();
+    if (!options.timeReport) {
+        return true;
+    }
+    // Fresh, but compiled without the report.
+    char timeReportPath[maxPath];
+    char absTimeReportPath[maxPath];
+    makeDerivedPath(profile->id, unitPath, sourcePath, ".time", timeReportPath);
+    return fileExists(rebase(timeReportPath, absTimeReportPath));
+}
+
+
+// Targets are made under lock of "<target>.lock", another cx building the
+// same tree may be making the same target.
+char* Builder::getLockPath(const char* targetPath, char* absLockPath) {
+    char lockPath[maxPath];
+    return rebase(addSuffix(targetPath, ".lock", lockPath), absLockPath);
 }
 
 
 bool Builder::updateSource(const char* sourcePath, bool skipDepsCheck, bool& recompiled, Dependencies& deps) {
     char objPath[maxPath];
-    makeDerivedPath(profile->id, sourcePath, ".o", objPath);
+    makeDerivedPath(profile->id, unitPath, sourcePath, ".o", objPath);
     recompiled = false;
-    uint8_t flags;
-    if (!(skipDepsCheck || options.force) && checkDeps(objPath, profile->tag, compiler->getCompilerOptionsTag(config, sourcePath), deps)) {
+    uint64_t profileTag = 0;
+    if (profile->pgo == Profile::pgoUse) {
+        char profilePath[maxPath];
+        makeDerivedPath(profile->id, unitPath, sourcePath, ".gcda", profilePath);
+        std::lock_guard<std::mutex> lock(fileStateCacheMutex);
+        profileTag = lookupFileTag(profilePath);
+    }
+    if (!(skipDepsCheck || options.force) && isObjectFresh(sourcePath, objPath, profileTag, deps)) {
+        return true;
+    }
+    // Checked again under the lock: another process may have just made it.
+    char lockPath[maxPath];
+    FileLock lock(getLockPath(objPath, lockPath));
+    if (!options.force && isObjectFresh(sourcePath, objPath, profileTag, deps)) {
+        TRACE("Using %s made by another process", objPath);
         return true;
     }
     recompiled = true;
-    return compiler->compile(config, sourcePath, deps);
+    char absSourcePath[maxPath];
+    WorkScope work(*master, BuildHistory::kindObject, rebase(sourcePath, absSourcePath));
+    work.done = compiler->compile(config, sourcePath, deps);
+    return work.done;
 }
 
 
-bool Builder::loadProfile(const char* configId) {
-    if (master == this) {
-        if (profile) {
-            delete profile;
-        }
-        profile = new Profile();
-        topPath[0] = 0;
-        char absProfilePath[maxPath];
-        strcpy(absProfilePath, unitPath);
-        short slashPos[maxPath / 2];
-        int slashCount = 0;
-        for (int i = 0; absProfilePath[i]; i++) {
-            if (absProfilePath[i] == '/') {
-                slashPos[slashCount++] = i;
-            }
-        }
-        for ( ; slashCount >= 2; slashCount--) {
-            int length = slashPos[slashCount - 1] + 1;
-            memcpy(absProfilePath + length, "cx.top", 7);
-            if (fileExists(absProfilePath)) {
-                TRACE("Found %s", absProfilePath);
-                if (!profile->commonConfig.load(absProfilePath, configId)) {
-                    return false;
-                }
-                memcpy(topPath, absProfilePath, length);
-                topPath[length] = 0;
-                profile->commonConfig.path = topPath;
-                break;
+// Find and load cx.top, if any. No compiler yet.
+bool Builder::loadTopConfig(const char* configId) {
+    if (profile) {
+        delete profile;
+    }
+    profile = new Profile();
+    if (strlen(configId) >= sizeof(profile->configId)) {
+        FAILURE("Configuration name is too long: %s", configId);
+        return false;
+    }
+    strcpy(profile->configId, configId);
+    profile->pgo = options.pgo;
+    profile->sampling = options.sampling;
+    snprintf(profile->id, sizeof(profile->id), "%s%s%s", configId,
+        options.pgo == Profile::pgoGenerate ? ".pgo-gen" : options.pgo == Profile::pgoUse ? ".pgo" : "",
+        options.sampling ? ".prof" : "");
+    topPath[0] = 0;
+    char absProfilePath[maxPath];
+    strcpy(absProfilePath, unitPath);
+    short slashPos[maxPath / 2];
+    int slashCount = 0;
+    for (int i = 0; absProfilePath[i]; i++) {
+        if (absProfilePath[i] == '/') {
+            slashPos[slashCount++] = i;
+        }
+    }
+    for ( ; slashCount >= 2; slashCount--) {
+        int length = slashPos[slashCount - 1] + 1;
+        memcpy(absProfilePath + length, "cx.top", 7);
+        if (fileExists(absProfilePath)) {
+            TRACE("Found %s", absProfilePath);
+            if (!profile->commonConfig.load(absProfilePath, configId)) {
+                return false;
             }
+            memcpy(topPath, absProfilePath, length);
+            topPath[length] = 0;
+            profile->commonConfig.path = topPath;
+            break;
+        }
+    }
+    // $CX_CACHE_ROOT overrides cx.top.
+    const char* root = getVariable("CX_CACHE_ROOT");
+    if (root && *root) {
+        char absRoot[maxPath];
+        setCacheRoot(rebasePath(currentDirectory, root, absRoot));
+    }
+    else {
+        setCacheRoot(profile->cacheRoot);
+    }
+    return true;
+}
+
+
+bool Builder::loadProfile(const char* configId) {
+    if (master == this && !(profile && keepProfile)) {
+        if (!loadTopConfig(configId)) {
+            return false;
         }
         if (compiler) {
             delete compiler;
         }
-        strcpy(profile->id, configId);
         compiler = new GccCompiler(*profile); // For now GCC only.
         compiler->keepDeps = options.keepDeps;
-    }
-    else {
-        currentDirectory = master->currentDirectory;
-        profile = master->profile;
-        compiler = master->compiler;
+        compiler->timeReport = options.timeReport;
     }
     return true;
 }
@@ -397,10 +737,11 @@ bool Builder::loadConfig(const char* configId) {
 bool Builder::createCacheDir(bool& created) {
     created = false;
     char cacheCommonPath[maxPath];
-    catPath(unitPath, cacheDirName, cacheCommonPath);
+    getCacheDirectory(unitPath, cacheCommonPath);
     if (!directoryExists(cacheCommonPath)) {
         created = true;
-        if (!makeDirectory(cacheCommonPath)) {
+        // Another cx may be creating it too.
+        if (!(cacheRoot ? makeDirectories(cacheCommonPath) : makeDirectory(cacheCommonPath) || directoryExists(cacheCommonPath))) {
             FAILURE("Failed to create directory %s", cacheCommonPath);
             return false;
         }
@@ -409,29 +750,33 @@ bool Builder::createCacheDir(bool& created) {
     catPath(cacheCommonPath, profile->id, cachePath);
     if (!directoryExists(cachePath)) {
         created = true;
-        if (!makeDirectory(cachePath)) {
+        if (!(makeDirectory(cachePath) || directoryExists(cachePath))) {
             FAILURE("Failed to create directory %s", cachePath);
             return false;
         }
     }
+    else {
+        touchFile(cachePath); // For least recently used eviction.
+    }
     return true;
 }
 
 
-// Start compiling sources.
-bool Builder::buildPhase1(const char* path, const char* configId) {
-    configId = master == this ? getConfigId(configId) : configId ? configId : master->profile->id;
-    if (!processPath(path)) {
-        return false;
-    }
+// Load unit configuration and find sources.
+bool Builder::scanUnit() {
     TRACE("Building %s", unitPath);
-    if (!(loadProfile(configId) && loadConfig(configId))) {
+    if (!loadConfig(profile->configId)) {
         return false;
     }
     {
         std::lock_guard<std::mutex> lock(master->masterMutex);
+        int unitLength = strlen(unitPath);
         for (StringList::Iterator i(config.externalLibs); i; i.next()) {
-            master->libDeps.put(i->string, i->length);
+            char item[maxPath * 2];
+            memcpy(item, unitPath, unitLength + 1);
+            memcpy(item + unitLength + 1, i->string, i->length);
+            StringDict::Entry* e;
+            master->unitLibDeps.add(item, unitLength + 1 + i->length, e);
         }
     }
     // Find sources.
@@ -441,165 +786,1487 @@ bool Builder::buildPhase1(const char* path, const char* configId) {
         return true;
     }
     // Create cache directory. Skip checking deps if it's empty.
-    bool skipDepsCheck = false;
-    if (!createCacheDir(skipDepsCheck)) {
-        return false;
-    }
-    // Start compiling unit sources.
-    unitDirDeps.put(1, unitPath);
+    return createCacheDir(skipDepsCheck);
+}
+
+
+// Start compiling unit sources.
+void Builder::startCompiling() {
     for (FileStateList::Iterator i(sources); i; i.next()) {
-        batch.send(new CompileJob(*this, i->string, skipDepsCheck));
+        master->batch.send(new CompileJob(*this, i->string, skipDepsCheck));
+        master->sourceCount++;
+        pendingCount++;
     }
-    return true;
 }
 
 
-// Wait for source compilation end, and do the rest.
-bool Builder::buildPhase2() {
-    bool anyRecompiled = false;
-    StringList objListMain;
-    StringList objList;
+// One more unit source is compiled (or found fresh).
+void Builder::onSourceDone(CompileJob* job) {
     char objPath[maxPath];
-    libsTag = 0;
-    uint64_t objTag = 0;
-    for (;;) {
-        BuilderJob* j = (CompileJob*)(batch.receive());
-        if (!j) {
-            break;
+    anyRecompiled |= job->recompiled;
+    makeDerivedPath(profile->id, unitPath, job->name, ".o", objPath);
+    if (job->hasMain) {
+        objListMain.add(objPath);
+        char absSourcePath[maxPath];
+        TRACE("Source %s defines main()", rebase(job->name, absSourcePath));
+    }
+    else {
+        objList.add(objPath);
+        std::lock_guard<std::mutex> lock(fileStateCacheMutex);
+        objTag += lookupFileTag(objPath);
+    }
+    if (master->collectInputs) {
+        for (Dependencies::Iterator i(job->deps); i; i.next()) {
+            inputs.add(i->tag, i->string, i->length);
         }
-        if (!j->ok) {
-            delete j;
-            return false;
+    }
+    if (master->options.watch) {
+        // Recompiled sources may have new dependencies, which were not looked up.
+        // Keep their states, to know which units the next changes affect.
+        std::lock_guard<std::mutex> lock(fileStateCacheMutex);
+        for (Dependencies::Iterator i(job->deps); i; i.next()) {
+            FileStateDict::Entry* entry;
+            fileStateCache.add(i->tag, i->string, i->length, entry);
+            char dir[maxPath];
+            char rebased[maxPath];
+            char normalized[maxPath];
+            normalizePath(rebase(getDirectory(i->string, dir), rebased), normalized);
+            StringDict::Entry* e;
+            master->inputDirs.add(normalized, e);
         }
-        if (j->type == jobTypeCompile) {
-            CompileJob* job = (CompileJob*)j;
-            anyRecompiled |= job->recompiled;
-            makeDerivedPath(profile->id, job->name, ".o", objPath);
-            if (job->hasMain) {
-                objListMain.add(objPath);
-                char absSourcePath[maxPath];
-                TRACE("Source %s defines main()", rebase(job->name, absSourcePath));
+    }
+    extractUnitDirDeps(job->deps);
+}
+
+
+// Continuations. What can be done next, once some job is done.
+bool Builder::onJobDone(BuilderJob* job) {
+    Builder& unit = job->builder;
+    if (!job->ok) {
+        if (!job->errors.isEmpty()) {
+            StringDict used;
+            {
+                std::lock_guard<std::mutex> lock(masterMutex);
+                collectUsedUnits(used);
             }
-            else {
-                objList.add(objPath);
-                objTag += lookupFileTag(objPath);
+            if (used.find(unit.unitPath)) {
+                delayedError(job->errors);
             }
-            if (!extractUnitDirDeps(job->deps)) {
-                delete job;
-                return false;
+            else {
+                for (StringList::Iterator i(job->errors); i; i.next()) {
+                    unit.heldErrors.add(i->string, i->length);
+                }
             }
         }
-        else if (j->type == jobTypeLibrary) {
-            LibraryJob* job = (LibraryJob*)j;
-            char libPath[maxPath];
-            uint64_t libTag = makeFileTag(makeDerivedPath(profile->id, job->builder.unitPath, "library", libPath));
-            std::lock_guard<std::mutex> lock(master->masterMutex);
-            master->unitDirDeps.put(2, job->builder.unitPath);
-            master->libsTag += libTag;
-        }
-        delete j;
+        delayedErrorFlush(); // Now, not when everything else is done.
+        // Might be a unit we don't need anymore, started speculatively.
+        // When testing, only tests depending on it fail.
+        markUnit(unit.unitPath, unitFlagFailed);
+        return options.test || options.keepGoing || checkUnitFailures();
     }
-    // Make unit library.
-    char libPath[maxPath];
-    makeDerivedPath(profile->id, "library", "", libPath);
-    if (!objList.isEmpty()) {
-        uint8_t flags;
-        if (anyRecompiled || options.force || !checkDeps(libPath, profile->tag, 0, objTag, flags)) {
-            char libDepsPath[maxPath];
-            char absLibDepsPath[maxPath];
-            rebase(addSuffix(libPath, ".deps", libDepsPath), absLibDepsPath);
-            if (!compiler->makeLibrary(config, libPath, objList)) {
-                deleteFile(absLibDepsPath);
-                return false;
-            }
-            DepsHeader header;
-            header.toolTag = profile->tag;
-            header.inputsTag = objTag;
-            save(absLibDepsPath, &header, sizeof(header));
+    switch (job->type) {
+        case jobTypeScan:
+            unit.startCompiling();
+            break;
+        case jobTypeCompile:
+            checkedCount++;
+            recompiledCount += ((CompileJob*)job)->recompiled;
+            unit.onSourceDone((CompileJob*)job);
+            unit.pendingCount--;
+            break;
+        case jobTypeArchive:
+            markUnit(unit.unitPath, unitFlagLibrary);
+            return true;
+        case jobTypeLink:
+        case jobTypeTest:
+            return true;
+    }
+    if (unit.pendingCount == 0 && !unit.objList.isEmpty()) {
+        batch.send(new ArchiveJob(unit));
+    }
+    return true;
+}
+
+
+// Receive done jobs, and send the next ones, until there is nothing to do.
+// On failure, drop the jobs not started yet, and kill compilers running.
+// Top level builder only.
+bool Builder::runJobs() {
+    while (BuilderJob* job = (BuilderJob*)(batch.receive())) {
+        bool ok = onJobDone(job);
+        delete job;
+        if (!ok) {
+            progressClear();
+            batch.cancel();
+            Runner::cancelAll();
+            return false;
         }
-        libsTag += makeFileTag(libPath);
-        master->unitDirDeps.put(2, unitPath);
+        showProgress();
     }
-    if (master != this) {
-        return true;
+    return true;
+}
+
+
+// Counts of compiled sources, and the time left, estimated from durations
+// in build history: what's being rebuilt now, plus the sources not checked
+// yet, assuming they need rebuilding as often as the checked ones did.
+void Builder::showProgress() {
+    int64_t now = getMonotonicTime();
+    if (logLevel != logLevelInfo || now - lastProgressTime < 100000000) {
+        return;
     }
-    // Link all (or one) objects with main().
-    if (options.skipLinking || objListMain.isEmpty()) {
-        return true;
+    lastProgressTime = now;
+    int running = workCount.load();
+    if (running == 0) {
+        return;
     }
-    char execPath[maxPath];
-    execPath[0] = 0;
-    char objectToRun[maxPath];
-    objectToRun[0] = 0;
-    if (sourceToRun[0]) {
-        makeDerivedPath(profile->id, sourceToRun, ".o", objectToRun);
+    int64_t left = workEstimate.load() - (running * now - workStartSum.load());
+    int64_t average;
+    {
+        std::lock_guard<std::mutex> lock(historyMutex);
+        average = history.getAverage(BuildHistory::kindObject);
     }
-    for (StringList::Iterator i(objListMain); i; i.next()) {
-        if (objectToRun[0] != 0 && strcmp(i->string, objectToRun) != 0) {
+    if (checkedCount) {
+        left += int64_t(double(sourceCount - checkedCount) * recompiledCount / checkedCount * average);
+    }
+    if (average == 0 || left <= 0) {
+        progress("[%d/%d] %d building", checkedCount, sourceCount, running);
+        return;
+    }
+    char text[32];
+    progress("[%d/%d] %d building, about %s left", checkedCount, sourceCount, running,
+        formatDuration(left / (maxThreads > 0 ? maxThreads : 1), text));
+}
+
+
+void Builder::printTimeReport(const StringDict& used) {
+    TimeReport report;
+    for (Builder* unit = this; unit; unit = unit == this ? units : unit->nextUnit) {
+        if (!used.find(unit->unitPath)) {
             continue;
         }
-        uint64_t execTag = lookupFileTag(i->string) + libsTag;
-        addSuffix(i->string, ".exe", execPath);
-        uint8_t flags;
-        if (anyRecompiled || options.force || !checkDeps(execPath, profile->tag, config.linkerOptionsTag, execTag, flags)) {
-            char execDepsPath[maxPath];
-            char absExecDepsPath[maxPath];
-            rebase(addSuffix(execPath, ".deps", execDepsPath), absExecDepsPath);
-            StringList execObjList;
-            execObjList.add(i->string, i->length);
-            StringList execLibList;
-            fillUnitLibList(execLibList);
-            if (!compiler->link(config, execPath, execObjList, execLibList)) {
-                deleteFile(absExecDepsPath);
-                return false;
+        for (FileStateList::Iterator i(unit->sources); i; i.next()) {
+            char objPath[maxPath];
+            char timeReportPath[maxPath];
+            char depsPath[maxPath];
+            char absPath[maxPath];
+            makeDerivedPath(profile->id, unit->unitPath, i->string, ".o", objPath);
+            makeDerivedPath(profile->id, unit->unitPath, i->string, ".time", timeReportPath);
+            Dependencies deps;
+            if (deps.load(unit->rebase(addSuffix(objPath, ".deps", depsPath), absPath))) {
+                report.add(unit->unitPath, i->string, unit->rebase(timeReportPath, absPath), deps);
             }
-            DepsHeader header;
-            header.toolTag = profile->tag;
-            header.optTag = config.linkerOptionsTag;
-            header.inputsTag = execTag;
-            save(absExecDepsPath, &header, sizeof(header));
-        }
-    }
-    // Run.
-    if (options.skipRunning) {
-        return true;
-    }
-    if (objectToRun[0] == 0) {
-        if (objListMain.getCount() > 1) {
-            FAILURE("In %s there are %d sources defining main(), specify source file name", unitPath, objListMain.getCount());
-            return false;
         }
     }
-    else if (execPath[0] == 0) {
-        if (objectToRun[0] == '.') {
-            FAILURE("Source names starting with . are not compiled, and not executed");
+    report.print(15);
+}
+
+
+// Estimates come from build history, including this build.
+void Builder::printImpact(const StringDict& used) {
+    char path[maxPath];
+    history.load(getHistoryPath(path));
+    ImpactReport report;
+    for (Builder* unit = this; unit; unit = unit == this ? units : unit->nextUnit) {
+        if (!used.find(unit->unitPath)) {
+            continue;
         }
-        return false;
-    }
-    const char* var = "EXECUTED_BY_CX";
-    if (getVariable(var)) {
-        FAILURE("Running itself is asking for an endless loop... Won't do that.");
-        return false;
-    }
-    else {
-        setVariable(var, "1");
-        char absExecPath[maxPath];
-        Runner runner;
-        runner.args.add(rebase(execPath, absExecPath));
-        if (options.runArgs) {
-            for (StringList::Iterator i(*options.runArgs); i; i.next()) {
-                runner.args.add(i->string, i->length);
+        for (FileStateList::Iterator i(unit->sources); i; i.next()) {
+            char objPath[maxPath];
+            char depsPath[maxPath];
+            char absPath[maxPath];
+            makeDerivedPath(profile->id, unit->unitPath, i->string, ".o", objPath);
+            Dependencies deps;
+            if (!deps.load(unit->rebase(addSuffix(objPath, ".deps", depsPath), absPath))) {
+                continue;
+            }
+            bool hasMain = deps.getHeader().flags & Compiler::flagHasMain;
+            int64_t linkTime = 0;
+            if (hasMain && unit == this) {
+                char execPath[maxPath];
+                linkTime = history.estimate(BuildHistory::kindProgram, rebase(addSuffix(objPath, ".exe", execPath), absPath));
             }
+            int64_t compileTime = history.estimate(BuildHistory::kindObject, unit->rebase(i->string, absPath));
+            report.addObject(unit->unitPath, deps, compileTime, hasMain, linkTime);
+        }
+        FileStateDict::Entry* entry = unitDirDeps.find(unit->unitPath);
+        if (entry && (entry->tag & unitFlagLibrary)) {
+            char libPath[maxPath];
+            char absLibPath[maxPath];
+            makeDerivedPath(profile->id, unit->unitPath, "library", "", libPath);
+            report.addLibrary(unit->unitPath, history.estimate(BuildHistory::kindLibrary, unit->rebase(libPath, absLibPath)));
         }
-        runner.exec();
     }
-    return true;
+    report.print(20);
 }
 
 
-bool Builder::build(const char* path, const char* configId) {
-    return buildPhase1(path, configId) && buildPhase2();
+char* Builder::getHistoryPath(char* path) {
+    char historyPath[maxPath];
+    makeDerivedPath(profile->id, unitPath, "history", "", historyPath);
+    return rebase(historyPath, path);
 }
 
 
+// Lazily, so builds with nothing to do don't pay for it. Under historyMutex.
+void Builder::loadHistory() {
+    if (!historyLoaded) {
+        char path[maxPath];
+        history.load(getHistoryPath(path));
+        historyLoaded = true;
+    }
+}
+
 
+void Builder::saveHistory() {
+    progressClear();
+    std::lock_guard<std::mutex> lock(historyMutex);
+    if (!history.isEmpty()) {
+        char path[maxPath];
+        history.save(getHistoryPath(path), buildStartTime, getCurrentTime() - buildStartTime);
+    }
+}
+
+
+bool Builder::showHistory(const char* path, const char* configId, int builds) {
+    configId = getConfigId(configId);
+    if (!(processPath(path) && loadTopConfig(configId))) {
+        return false;
+    }
+    char historyPath[maxPath];
+    INFO("Build history of %s%s%s [%s]", em, unitPath, noem, profile->id);
+    history.load(getHistoryPath(historyPath));
+    history.report(builds, 10);
+    return true;
+}
+
+
+// Make unit library, if anything has changed.
+bool Builder::updateLibrary() {
+    char libPath[maxPath];
+    makeDerivedPath(profile->id, unitPath, "library", "", libPath);
+    uint8_t flags;
+    if (anyRecompiled || options.force || !checkDeps(libPath, profile->tag, 0, objTag, flags)) {
+        char lockPath[maxPath];
+        FileLock lock(getLockPath(libPath, lockPath));
+        if (!(anyRecompiled || options.force) && checkDeps(libPath, profile->tag, 0, objTag, flags)) {
+            TRACE("Using %s made by another process", libPath);
+            return true;
+        }
+        char libDepsPath[maxPath];
+        char absLibDepsPath[maxPath];
+        rebase(addSuffix(libPath, ".deps", libDepsPath), absLibDepsPath);
+        char absLibPath[maxPath];
+        WorkScope work(*master, BuildHistory::kindLibrary, rebase(libPath, absLibPath));
+        if (!compiler->makeLibrary(config, libPath, objList)) {
+            deleteFile(absLibDepsPath);
+            return false;
+        }
+        DepsHeader header;
+        header.toolTag = profile->tag;
+        header.inputsTag = objTag;
+        save(absLibDepsPath, &header, sizeof(header));
+        work.done = true;
+    }
+    return true;
+}
+
+
+// Link one program, if anything has changed.
+bool Builder::updateExecutable(const char* objPath, const StringList& libList, uint64_t libsTag) {
+    char execPath[maxPath];
+    uint64_t execTag;
+    {
+        std::lock_guard<std::mutex> lock(fileStateCacheMutex);
+        execTag = lookupFileTag(objPath) + libsTag;
+    }
+    addSuffix(objPath, ".exe", execPath);
+    uint8_t flags;
+    if (anyRecompiled || options.force || !checkDeps(execPath, profile->tag, config.linkerOptionsTag, execTag, flags)) {
+        char lockPath[maxPath];
+        FileLock lock(getLockPath(execPath, lockPath));
+        if (!(anyRecompiled || options.force) && checkDeps(execPath, profile->tag, config.linkerOptionsTag, execTag, flags)) {
+            TRACE("Using %s made by another process", execPath);
+            return true;
+        }
+        char execDepsPath[maxPath];
+        char absExecDepsPath[maxPath];
+        rebase(addSuffix(execPath, ".deps", execDepsPath), absExecDepsPath);
+        char absExecPath[maxPath];
+        WorkScope work(*master, BuildHistory::kindProgram, rebase(execPath, absExecPath));
+        StringList execObjList;
+        execObjList.add(objPath);
+        if (!compiler->link(config, execPath, execObjList, libList)) {
+            deleteFile(absExecDepsPath);
+            return false;
+        }
+        DepsHeader header;
+        header.toolTag = profile->tag;
+        header.optTag = config.linkerOptionsTag;
+        header.inputsTag = execTag;
+        save(absExecDepsPath, &header, sizeof(header));
+        work.done = true;
+    }
+    return true;
+}
+
+
+// Link all (or one) objects with main(), and run.
+bool Builder::linkAndRun() {
+    if (options.skipLinking || objListMain.isEmpty()) {
+        return true;
+    }
+    char execPath[maxPath];
+    execPath[0] = 0;
+    char objectToRun[maxPath];
+    objectToRun[0] = 0;
+    libsTag = fillUnitLibList(libList);
+    if (sourceToRun[0]) {
+        makeDerivedPath(profile->id, unitPath, sourceToRun, ".o", objectToRun);
+    }
+    for (StringList::Iterator i(objListMain); i; i.next()) {
+        if (objectToRun[0] != 0 && strcmp(i->string, objectToRun) != 0) {
+            continue;
+        }
+        addSuffix(i->string, ".exe", execPath);
+        batch.send(new LinkJob(*this, i->string, libList, libsTag));
+    }
+    if (!runJobs()) {
+        return false;
+    }
+    // Run.
+    if (options.skipRunning) {
+        return true;
+    }
+    if (objectToRun[0] == 0) {
+        if (objListMain.getCount() > 1) {
+            FAILURE("In %s there are %d sources defining main(), specify source file name", unitPath, objListMain.getCount());
+            return false;
+        }
+    }
+    else if (execPath[0] == 0) {
+        if (objectToRun[0] == '.') {
+            FAILURE("Source names starting with . are not compiled, and not executed");
+        }
+        return false;
+    }
+    if (options.watch || options.skipExec) {
+        rebase(execPath, programPath);
+        return true;
+    }
+    char absExecPath[maxPath];
+    rebase(execPath, absExecPath);
+    saveHistory();
+    saveRunManifest(absExecPath);
+    return execProgram(absExecPath);
+}
+
+
+bool Builder::execProgram(const char* absExecPath) {
+    const char* var = "EXECUTED_BY_CX";
+    if (getVariable(var)) {
+        FAILURE("Running itself is asking for an endless loop... Won't do that.");
+        return false;
+    }
+    setVariable(var, "1");
+    Runner runner;
+    runner.args.add(absExecPath);
+    if (options.runArgs) {
+        for (StringList::Iterator i(*options.runArgs); i; i.next()) {
+            runner.args.add(i->string, i->length);
+        }
+    }
+    runner.exec();
+    return true;
+}
+
+
+// A run manifest lists tags of everything the program was built from: sources
+// and headers of all used units, unit directories themselves (for added
+// sources), configuration files and the tools. The first entry is the program.
+// Directory entries end with '/', their tags are modification times.
+char* Builder::getRunManifestPath(char* path) {
+    char manifestPath[maxPath];
+    if (*sourceToRun) {
+        makeDerivedPath(profile->id, unitPath, sourceToRun, ".manifest", manifestPath);
+    }
+    else {
+        makeDerivedPath(profile->id, unitPath, "run", ".manifest", manifestPath);
+    }
+    return rebase(manifestPath, path);
+}
+
+
+static uint64_t getEnvironmentTag() {
+    const char* path = getVariable("PATH");
+    return hash64(path ? path : "");
+}
+
+
+void Builder::saveRunManifest(const char* absExecPath) {
+    if (!collectInputs) {
+        return;
+    }
+    Dependencies manifest;
+    manifest.getHeader().optTag = getEnvironmentTag();
+    manifest.add(makeFileTag(absExecPath), absExecPath);
+    StringDict used;
+    collectUsedUnits(used);
+    char absPath[maxPath];
+    for (Builder* unit = this; unit; unit = unit == this ? units : unit->nextUnit) {
+        if (!used.find(unit->unitPath)) {
+            continue;
+        }
+        manifest.add(makeDirectoryTag(unit->unitPath), unit->unitPath);
+        catPath(unit->unitPath, "cx.unit", absPath);
+        manifest.add(makeFileTag(absPath), absPath);
+        for (FileStateList::Iterator i(unit->inputs); i; i.next()) {
+            manifest.add(i->tag, unit->rebase(i->string, absPath));
+        }
+    }
+    if (*topPath) {
+        catPath(topPath, "cx.top", absPath);
+        manifest.add(makeFileTag(absPath), absPath);
+    }
+    const char* tools[] = {profile->c, profile->cxx, profile->linker};
+    for (const char* tool: tools) {
+        if (*findProgram(tool, absPath)) {
+            manifest.add(makeFileTag(absPath), absPath);
+        }
+    }
+    TRACE("Saving run manifest, %d entries", manifest.getCount());
+    manifest.save(getRunManifestPath(absPath));
+}
+
+
+// Fast path. If nothing changed since the last run, exec the program right
+// away: no compiler version check, no scanning, no dependency checking.
+bool Builder::runCached() {
+    char absPath[maxPath];
+    Dependencies manifest;
+    if (!manifest.load(getRunManifestPath(absPath)) || manifest.getHeader().optTag != getEnvironmentTag()) {
+        return false;
+    }
+    // Found by loadTopConfig(). It may have been created since the manifest was saved.
+    char topConfigPath[maxPath];
+    bool topConfigListed = !*topPath;
+    if (*topPath) {
+        catPath(topPath, "cx.top", topConfigPath);
+    }
+    const char* execPath = nullptr;
+    for (Dependencies::Iterator i(manifest); i; i.next()) {
+        bool isDir = i->length && i->string[i->length - 1] == '/';
+        if ((isDir ? makeDirectoryTag(i->string) : makeFileTag(i->string)) != i->tag) {
+            TRACE("Changed: %s", i->string);
+            return false;
+        }
+        if (!execPath) {
+            execPath = i->string;
+        }
+        topConfigListed |= *topPath && strcmp(i->string, topConfigPath) == 0;
+    }
+    if (!topConfigListed) {
+        TRACE("New: %s", topConfigPath);
+        return false;
+    }
+    if (!execPath) {
+        return false;
+    }
+    TRACE("Nothing changed, running %s", execPath);
+    return execProgram(execPath);
+}
+
+
+// Forget everything about the previous build, except the profile.
+void Builder::reset() {
+    batch.discard();
+    Runner::resume();
+    while (Builder* unit = units) {
+        units = unit->nextUnit;
+        delete unit;
+    }
+    unitDirDeps.clear();
+    unitEdges.clear();
+    unitLibDeps.clear();
+    inputDirs.clear();
+    resetUnit();
+    historyLoaded = false;
+    sourceCount = 0;
+    checkedCount = 0;
+    recompiledCount = 0;
+}
+
+
+// Unit build state, so the unit can be built again. Its configuration,
+// sources and file states are kept.
+void Builder::resetUnit() {
+    objList.clear();
+    objListMain.clear();
+    libList.clear();
+    inputs.clear();
+    skipDepsCheck = false;
+    anyRecompiled = false;
+    pendingCount = 0;
+    objTag = 0;
+    libsTag = 0;
+}
+
+
+bool Builder::build(const char* path, const char* configId) {
+    configId = getConfigId(configId);
+    if (!processPath(path)) {
+        return false;
+    }
+    collectInputs = !(options.skipRunning || options.skipLinking || options.skipExec || options.watch || options.test);
+    if (collectInputs && !options.force) {
+        // Cache root may come from cx.top, so it's needed to find the manifest.
+        if (!loadTopConfig(configId)) {
+            return false;
+        }
+        if (runCached()) {
+            return true;
+        }
+    }
+    buildStartTime = getCurrentTime();
+    if (!(loadProfile(configId) && scanUnit())) {
+        return false;
+    }
+    if (sources.isEmpty()) {
+        return true;
+    }
+    unitDirDeps.put(unitFlagStarted, unitPath);
+    startCompiling();
+    prefetchUnits();
+    return finishBuild();
+}
+
+
+// Units are started, wait for them, then link.
+bool Builder::finishBuild() {
+    bool ok = runJobs();
+    // All units are done (or cancelled), the graph is as complete as it gets.
+    StringDict used;
+    collectUsedUnits(used);
+    releaseHeldErrors(used);
+    if (!ok || !checkUnitFailures()) {
+        return false;
+    }
+    saveUnitGraph(used);
+    if (options.timeReport) {
+        printTimeReport(used);
+    }
+    autoCollectGarbage();
+    ok = linkAndRun();
+    saveHistory();
+    if (ok && options.impact) {
+        printImpact(used);
+    }
+    return ok;
+}
+
+
+// Watch mode. Update cached states of the changed files (absolute, normalized
+// paths) this unit depends on. Returns true if there were any.
+bool Builder::refreshFileTags(const StringDict& changed) {
+    bool any = false;
+    for (FileStateDict::Iterator i(fileStateCache); i; i.next()) {
+        char absPath[maxPath];
+        char normalized[maxPath];
+        if (changed.find(normalizePath(rebase(i->string, absPath), normalized))) {
+            i->tag = makeFileTag(normalized);
+            any = true;
+        }
+    }
+    return any;
+}
+
+
+// Drop "first\0second" pairs with the first part in the set.
+static void removePairs(StringDict& pairs, const StringDict& firsts) {
+    StringList kept;
+    for (StringDict::Iterator i(pairs); i; i.next()) {
+        if (!firsts.find(i->string)) {
+            kept.add(i->string, i->length);
+        }
+    }
+    pairs.clear();
+    for (StringList::Iterator i(kept); i; i.next()) {
+        StringDict::Entry* e;
+        pairs.add(i->string, i->length, e);
+    }
+}
+
+
+// Watch mode, the next round. Unit builders, their configurations and file
+// states are kept from the previous one. Only units depending on the changed
+// files are checked again, and only those with files added or removed, or
+// cx.unit changed, are scanned again.
+bool Builder::rebuild(const StringList& changed) {
+    batch.discard();
+    Runner::resume();
+    historyLoaded = false;
+    sourceCount = 0;
+    checkedCount = 0;
+    recompiledCount = 0;
+    buildStartTime = getCurrentTime();
+    libList.clear();
+    StringDict changedPaths;
+    for (StringList::Iterator i(changed); i; i.next()) {
+        StringDict::Entry* e;
+        changedPaths.add(i->string, i->length, e);
+    }
+    StringDict affected;
+    StringDict rescanned;
+    for (Builder* unit = this; unit; unit = unit == this ? units : unit->nextUnit) {
+        int unitLength = strlen(unit->unitPath);
+        bool rescan = false;
+        for (StringList::Iterator i(changed); i; i.next()) {
+            if (getDirectoryPartLength(i->string) != unitLength || strncmp(i->string, unit->unitPath, unitLength) != 0) {
+                continue;
+            }
+            // Added or removed, not just modified.
+            const char* name = i->string + unitLength;
+            rescan |= strcmp(name, "cx.unit") == 0 || !unit->fileStateCache.find(name) || !fileExists(i->string);
+        }
+        FileStateDict::Entry* entry = unitDirDeps.find(unit->unitPath);
+        rescan |= !entry || (entry->tag & unitFlagFailed);
+        if (!(unit->refreshFileTags(changedPaths) || rescan)) {
+            continue;
+        }
+        StringDict::Entry* e;
+        affected.add(unit->unitPath, e);
+        if (rescan) {
+            rescanned.add(unit->unitPath, e);
+        }
+    }
+    TRACE("Changes affect %d units, %d to scan", affected.getCount(), rescanned.getCount());
+    // Edges and external libs of these are found again.
+    removePairs(unitEdges, affected);
+    removePairs(unitLibDeps, rescanned);
+    if (affected.find(unitPath)) {
+        resetUnit();
+        if (rescanned.find(unitPath)) {
+            if (!scanUnit()) {
+                return false;
+            }
+            if (sources.isEmpty()) {
+                return true;
+            }
+        }
+        unitDirDeps.put(unitFlagStarted, unitPath);
+        startCompiling();
+    }
+    for (Builder* unit = units; unit; unit = unit->nextUnit) {
+        if (!affected.find(unit->unitPath)) {
+            continue;
+        }
+        unit->resetUnit();
+        unitDirDeps.put(unitFlagStarted, unit->unitPath);
+        if (rescanned.find(unit->unitPath)) {
+            batch.send(new ScanJob(*unit));
+        }
+        else {
+            unit->startCompiling();
+        }
+    }
+    return finishBuild();
+}
+
+
+bool Builder::collectGarbage(const char* path, const char* configId) {
+    configId = getConfigId(configId);
+    if (!(processPath(path) && loadTopConfig(configId))) {
+        return false;
+    }
+    return collectGarbage(unitPath);
+}
+
+
+bool Builder::collectGarbage(const char* dir) {
+    CacheCollector collector;
+    collector.currentConfigId = profile->id;
+    collector.sizeLimit = profile->cacheLimit;
+    if (!collector.collect(dir)) {
+        return false;
+    }
+    char size[32];
+    INFO("Deleted %d files, %s", collector.filesDeleted, formatSize(collector.bytesFreed, size));
+    return true;
+}
+
+
+// With cache_limit set in cx.top, collect garbage in the whole tree once a day.
+void Builder::autoCollectGarbage() {
+    if (!profile->cacheLimit || !*topPath) {
+        return;
+    }
+    char stampPath[maxPath];
+    getCacheDirectory(topPath, stampPath);
+    makeDirectories(stampPath);
+    catPath(stampPath, "gc", stampPath);
+    const int64_t day = int64_t(24 * 3600) * 1000000000;
+    if (getCurrentTime() - getFileTime(stampPath) < day) {
+        return;
+    }
+    TRACE("Collecting garbage in %s", topPath);
+    Blob().save(stampPath);
+    collectGarbage(topPath);
+}
+
+
+// Start all units in the directory tree.
+void Builder::findUnits(const char* path) {
+    StringList subdirs;
+    bool hasSources = false;
+    Directory dir(path);
+    for (Directory::Entry entry; dir.read(entry, false); ) {
+        if (entry.type == Directory::typeDirectory) {
+            char subdir[maxPath];
+            int length = strlen(catPath(path, entry.name, subdir));
+            subdir[length] = '/';
+            subdir[length + 1] = 0;
+            subdirs.add(subdir, length + 1);
+        }
+        else {
+            FileType type = getFileType(entry.name);
+            hasSources |= type == typeCSource || type == typeCppSource;
+        }
+    }
+    if (hasSources) {
+        FileStateDict::Entry* entry;
+        std::unique_lock<std::mutex> lock(masterMutex);
+        if (unitDirDeps.add(unitFlagStarted, path, entry)) {
+            lock.unlock();
+            startUnit(path);
+        }
+    }
+    for (StringList::Iterator i(subdirs); i; i.next()) {
+        findUnits(i->string);
+    }
+}
+
+
+// Absolute source path by object path.
+char* Builder::getTestSource(const char* objPath, char* absSourcePath) {
+    char sourceName[maxPath];
+    strcpy(sourceName, objPath + getDirectoryPartLength(objPath));
+    int length = strlen(sourceName);
+    if (length > 2 && strcmp(sourceName + length - 2, ".o") == 0) {
+        sourceName[length - 2] = 0;
+    }
+    return rebase(sourceName, absSourcePath);
+}
+
+
+// Is the source of this object a test (in the directory being tested, and matches the filter)?
+bool Builder::isTest(const char* objPath) {
+    if (strncmp(unitPath, master->unitPath, strlen(master->unitPath)) != 0) {
+        return false;
+    }
+    if (!master->options.testFilter || !*master->options.testFilter) {
+        return true;
+    }
+    char absSourcePath[maxPath];
+    const char* sourceName = getTestSource(objPath, absSourcePath) + strlen(unitPath);
+    return fnmatch(master->options.testFilter, sourceName, 0) == 0;
+}
+
+
+// Tag of a data file, or of everything under a data directory. Entries are
+// summed, so the order in which the directory lists them does not matter.
+static uint64_t makeDataTag(const char* path) {
+    if (!directoryExists(path)) {
+        return makeFileTag(path);
+    }
+    uint64_t tag = makeDirectoryTag(path);
+    Directory dir(path);
+    char absPath[maxPath];
+    for (Directory::Entry entry; dir.read(entry); ) {
+        catPath(path, entry.name, absPath);
+        uint64_t entryTag = entry.type == Directory::typeDirectory ? makeDataTag(absPath) :
+                            entry.type == Directory::typeLink ? makeFileTag(absPath) : entry.tag;
+        tag += combineHash(hash64(entry.name), entryTag);
+    }
+    return tag;
+}
+
+
+// Test needs to run again if its executable, its data files or its arguments have changed.
+uint64_t Builder::getTestTag(const char* execPath) {
+    char absPath[maxPath];
+    uint64_t tag = makeFileTag(rebase(execPath, absPath));
+    for (StringList::Iterator i(config.testData); i; i.next()) {
+        tag = combineHash(tag, makeDataTag(i->string));
+    }
+    if (master->options.runArgs) {
+        tag = combineHash(tag, getStringListHash(*master->options.runArgs));
+    }
+    return tag;
+}
+
+
+bool Builder::runTest(const char* execPath, Runner& runner) {
+    char absExecPath[maxPath];
+    runner.currentDirectory = unitPath;
+    runner.timeout = master->options.testTimeout;
+    runner.args.add(rebase(execPath, absExecPath));
+    if (master->options.runArgs) {
+        for (StringList::Iterator i(*master->options.runArgs); i; i.next()) {
+            runner.args.add(i->string, i->length);
+        }
+    }
+    return runner.run() && runner.exitStatus == 0;
+}
+
+
+// Build everything in the directory tree, link and run all tests (sources with main()).
+// Tests are run in parallel, each one as soon as it is linked.
+bool Builder::test(const char* path, const char* configId) {
+    configId = getConfigId(configId);
+    options.test = true;
+    options.skipRunning = false;
+    buildStartTime = getCurrentTime();
+    if (!(processPath(path) && loadProfile(configId))) {
+        return false;
+    }
+    if (sourceToRun[0]) {
+        FAILURE("Expected a directory to test: %s", path);
+        return false;
+    }
+    if (!scanUnit()) {
+        return false;
+    }
+    unitDirDeps.put(unitFlagStarted, unitPath);
+    startCompiling();
+    findUnits(unitPath);
+    runJobs();
+    setVariable("EXECUTED_BY_CX", "1");
+    int passed = 0;
+    int failed = 0;
+    int skipped = 0;
+    for (Builder* unit = this; unit; unit = unit == this ? units : unit->nextUnit) {
+        bool libsReady = false;
+        for (StringList::Iterator i(unit->objListMain); i; i.next()) {
+            if (!unit->isTest(i->string)) {
+                continue;
+            }
+            char absSourcePath[maxPath];
+            unit->getTestSource(i->string, absSourcePath);
+            if (!libsReady) {
+                unit->libsTag = fillUnitLibList(unit->libList, unit->unitPath);
+                libsReady = true;
+            }
+            if (!checkUnitFailures(unit->unitPath)) {
+                FAILURE("%s%s%s: build failed", em, absSourcePath, noem);
+                failed++;
+                continue;
+            }
+            batch.send(new LinkJob(*unit, i->string, unit->libList, unit->libsTag));
+        }
+    }
+    while (BuilderJob* j = (BuilderJob*)(batch.receive())) {
+        Builder& unit = j->builder;
+        if (j->type == jobTypeLink) {
+            LinkJob* job = (LinkJob*)j;
+            char execPath[maxPath];
+            char testPath[maxPath];
+            char absTestPath[maxPath];
+            char absSourcePath[maxPath];
+            addSuffix(job->objPath, ".exe", execPath);
+            unit.rebase(addSuffix(execPath, ".test", testPath), absTestPath);
+            unit.getTestSource(job->objPath, absSourcePath);
+            DepsHeader header;
+            if (!job->ok) {
+                FAILURE("%s%s%s: linking failed", em, absSourcePath, noem);
+                failed++;
+            }
+            else if (!options.force && header.load(absTestPath) && header.toolTag == profile->tag && header.inputsTag == unit.getTestTag(execPath)) {
+                TRACE("Test %s is unchanged, skipping", absSourcePath);
+                skipped++;
+            }
+            else {
+                deleteFile(absTestPath);
+                batch.send(new TestJob(unit, execPath, absSourcePath));
+            }
+        }
+        else if (j->type == jobTypeTest) {
+            TestJob* job = (TestJob*)j;
+            if (job->ok) {
+                INFO("PASSED %s (%.2f s)", job->sourcePath, job->seconds);
+                char testPath[maxPath];
+                char absTestPath[maxPath];
+                unit.rebase(addSuffix(job->execPath, ".test", testPath), absTestPath);
+                DepsHeader header;
+                header.toolTag = profile->tag;
+                header.inputsTag = unit.getTestTag(job->execPath);
+                header.save(absTestPath);
+                passed++;
+            }
+            else {
+                FAILURE("%s %s%s%s (%.2f s)", job->runner.timedOut ? "TIMED OUT" : "FAILED", em, job->sourcePath, noem, job->seconds);
+                printOutput(job->runner.output);
+                failed++;
+            }
+        }
+        delete j;
+    }
+    saveHistory();
+    INFO("Tests: %d passed, %d failed, %d skipped (unchanged)", passed, failed, skipped);
+    return failed == 0;
+}
+
+
+// Build and run. Then, whenever anything the program depends on changes,
+// rebuild what's needed and restart it. Toolchain information, unit builders
+// with their configurations and file states, and the unit graph are kept
+// between rounds, unless cx.top changes (see rebuild()).
+bool Builder::watch(const char* path, const char* configId) {
+    const char* var = "EXECUTED_BY_CX";
+    if (getVariable(var)) {
+        FAILURE("Running itself is asking for an endless loop... Won't do that.");
+        return false;
+    }
+    setVariable(var, "1");
+    options.watch = true;
+    Watcher watcher;
+    if (!watcher) {
+        return false;
+    }
+    Runner program;
+    const int quietMs = 100;
+    StringList changed;
+    bool rebuilding = false;
+    for (;;) {
+        programPath[0] = 0;
+        if ((rebuilding ? rebuild(changed) : build(path, configId)) && programPath[0]) {
+            program.args.clear();
+            program.args.add(programPath);
+            if (options.runArgs) {
+                for (StringList::Iterator i(*options.runArgs); i; i.next()) {
+                    program.args.add(i->string, i->length);
+                }
+            }
+            program.start();
+        }
+        delayedErrorFlush();
+        if (!unitPath[0]) {
+            return false;
+        }
+        if (topPath[0]) {
+            watcher.add(topPath);
+        }
+        watcher.add(unitPath);
+        for (FileStateDict::Iterator i(unitDirDeps); i; i.next()) {
+            watcher.add(i->string);
+        }
+        // Headers may be outside of units, e.g. in include_path directories.
+        for (StringDict::Iterator i(inputDirs); i; i.next()) {
+            watcher.add(i->string);
+        }
+        INFO("Watching for changes...");
+        changed.clear();
+        if (!watcher.wait(quietMs, changed)) {
+            return false;
+        }
+        keepProfile = true;
+        for (StringList::Iterator i(changed); i; i.next()) {
+            if (strcmp(i->string + getDirectoryPartLength(i->string), "cx.top") == 0) {
+                keepProfile = false;
+            }
+        }
+        program.stop();
+        // Start over if the first round did not get as far as the profile,
+        // or cx.top (the profile) has changed.
+        rebuilding = keepProfile && profile && compiler;
+        if (!rebuilding) {
+            reset();
+        }
+    }
+}
+
+
+// Profile data of the instrumented variant, for all used units. GCC writes it
+// next to object files, ".gcda" instead of ".o".
+void Builder::resetProfiles() {
+    StringDict used;
+    collectUsedUnits(used);
+    for (Builder* unit = this; unit; unit = unit == this ? units : unit->nextUnit) {
+        if (!used.find(unit->unitPath)) {
+            continue;
+        }
+        for (FileStateList::Iterator i(unit->sources); i; i.next()) {
+            char profilePath[maxPath];
+            char absProfilePath[maxPath];
+            makeDerivedPath(profile->id, unit->unitPath, i->string, ".gcda", profilePath);
+            deleteFile(unit->rebase(profilePath, absProfilePath));
+        }
+    }
+}
+
+
+// Copy profile data to where the optimized variant expects it. Unchanged files
+// are left alone, so objects depending on them are not recompiled.
+int Builder::publishProfiles(const char* useId) {
+    int count = 0;
+    StringDict used;
+    collectUsedUnits(used);
+    for (Builder* unit = this; unit; unit = unit == this ? units : unit->nextUnit) {
+        if (!used.find(unit->unitPath)) {
+            continue;
+        }
+        char useDir[maxPath];
+        char cacheCommonPath[maxPath];
+        catPath(getCacheDirectory(unit->unitPath, cacheCommonPath), useId, useDir);
+        if (!directoryExists(useDir) && !makeDirectory(useDir)) {
+            FAILURE("Failed to create directory %s", useDir);
+            continue;
+        }
+        for (FileStateList::Iterator i(unit->sources); i; i.next()) {
+            char path[maxPath];
+            char absPath[maxPath];
+            Blob data;
+            makeDerivedPath(profile->id, unit->unitPath, i->string, ".gcda", path);
+            bool trained = data.load(unit->rebase(path, absPath));
+            makeDerivedPath(useId, unit->unitPath, i->string, ".gcda", path);
+            unit->rebase(path, absPath);
+            if (!trained) {
+                // Not executed by training. A profile of an earlier one is stale now.
+                if (fileExists(absPath)) {
+                    TRACE("Profile data removed: %s", absPath);
+                    if (!deleteFile(absPath)) {
+                        FAILURE("Failed to delete %s", absPath);
+                    }
+                    count++;
+                }
+                continue;
+            }
+            Blob old;
+            if (old.load(absPath) && old.size == data.size && memcmp(old.data, data.data, data.size) == 0) {
+                continue;
+            }
+            TRACE("Profile data changed: %s", absPath);
+            uint64_t oldTag = makeFileTag(absPath);
+            if (!data.save(absPath)) {
+                FAILURE("Failed to write %s", absPath);
+            }
+            else if (makeFileTag(absPath) == oldTag) {
+                // Same size, within the same second. Make sure it looks changed.
+                setFileTime(absPath, getFileTime(absPath) + 1000000000);
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+
+// Profile guided optimization: build the instrumented variant, run it with
+// the given arguments, then rebuild the optimized variant with the new profile data.
+bool Builder::train(const char* path, const char* configId) {
+    configId = getConfigId(configId);
+    Builder generator;
+    generator.options = options;
+    generator.options.pgo = Profile::pgoGenerate;
+    generator.options.skipExec = true;
+    generator.programPath[0] = 0;
+    if (!generator.build(path, configId)) {
+        return false;
+    }
+    if (!generator.programPath[0]) {
+        FAILURE("Nothing to train, specify the program to run");
+        return false;
+    }
+    generator.resetProfiles();
+    INFO("Training %s", generator.programPath);
+    Runner runner;
+    runner.args.add(generator.programPath);
+    if (options.runArgs) {
+        for (StringList::Iterator i(*options.runArgs); i; i.next()) {
+            runner.args.add(i->string, i->length);
+        }
+    }
+    if (!(runner.start() && runner.wait())) {
+        FAILURE("Failed to run %s", generator.programPath);
+        return false;
+    }
+    if (runner.exitStatus != 0) {
+        FAILURE("Training run of %s failed", generator.programPath);
+        return false;
+    }
+    char useId[maxConfigId + 16];
+    snprintf(useId, sizeof(useId), "%s.pgo", configId);
+    int changed = generator.publishProfiles(useId);
+    INFO("Profile data changed for %d sources", changed);
+    Builder user;
+    user.options = options;
+    user.options.pgo = Profile::pgoUse;
+    user.options.skipRunning = true;
+    return user.build(path, configId);
+}
+
+
+// Results of the last run are kept next to the program, as "<program>.bench",
+// and named baselines as "<program>.bench.<name>".
+bool Builder::bench(const char* path, const char* configId, const BenchOptions& bench) {
+    options.skipExec = true;
+    programPath[0] = 0;
+    if (!build(path, configId)) {
+        return false;
+    }
+    if (!programPath[0]) {
+        FAILURE("Nothing to benchmark, specify the program to run");
+        return false;
+    }
+    Runner runner;
+    runner.args.add(programPath);
+    if (options.runArgs) {
+        for (StringList::Iterator i(*options.runArgs); i; i.next()) {
+            runner.args.add(i->string, i->length);
+        }
+    }
+    runner.cpu = bench.cpu;
+    runner.noAslr = bench.noAslr;
+    INFO("Benchmarking %s, %d runs", programPath, bench.runs);
+    BenchResults results;
+    for (int i = 0; i < bench.warmup + bench.runs; i++) {
+        runner.quiet = i > 0; // Output of the first run only.
+        int64_t start = getMonotonicTime();
+        if (!(runner.start() && runner.wait())) {
+            progressClear();
+            FAILURE("Failed to run %s", programPath);
+            return false;
+        }
+        int64_t wall = getMonotonicTime() - start;
+        if (runner.exitStatus != 0) {
+            progressClear();
+            FAILURE("Benchmark run of %s failed", programPath);
+            return false;
+        }
+        if (i >= bench.warmup) {
+            results.add(wall, runner.cpuTime);
+        }
+        progress("Run %d of %d", i + 1, bench.warmup + bench.runs);
+    }
+    progressClear();
+    results.print();
+    char resultsPath[maxPath];
+    addSuffix(programPath, ".bench", resultsPath);
+    char baselinePath[maxPath * 2];
+    BenchResults base;
+    if (bench.baseline) {
+        snprintf(baselinePath, sizeof(baselinePath), "%s.%s", resultsPath, bench.baseline);
+        if (!base.load(baselinePath)) {
+            FAILURE("No baseline %s for %s", bench.baseline, programPath);
+            return false;
+        }
+        char name[maxPath];
+        snprintf(name, sizeof(name), "baseline %s", bench.baseline);
+        results.compare(base, name);
+    }
+    else if (base.load(resultsPath)) {
+        results.compare(base, "previous run");
+    }
+    if (!results.save(resultsPath)) {
+        FAILURE("Cannot save %s", resultsPath);
+        return false;
+    }
+    if (bench.saveBaseline) {
+        snprintf(baselinePath, sizeof(baselinePath), "%s.%s", resultsPath, bench.saveBaseline);
+        if (!results.save(baselinePath)) {
+            FAILURE("Cannot save %s", baselinePath);
+            return false;
+        }
+        INFO("Saved as baseline %s", bench.saveBaseline);
+    }
+    return true;
+}
+
+
+// Built with frame pointers and debug info, as a separate configuration, so
+// the regular build stays as it is. Folded stacks are kept next to the
+// program, as "<program>.folded".
+bool Builder::sample(const char* path, const char* configId, int frequency) {
+    options.sampling = true;
+    options.skipExec = true;
+    programPath[0] = 0;
+    if (!build(path, configId)) {
+        return false;
+    }
+    if (!programPath[0]) {
+        FAILURE("Nothing to profile, specify the program to run");
+        return false;
+    }
+    Runner runner;
+    runner.args.add(programPath);
+    if (options.runArgs) {
+        for (StringList::Iterator i(*options.runArgs); i; i.next()) {
+            runner.args.add(i->string, i->length);
+        }
+    }
+    runner.held = true;
+    if (!runner.start()) {
+        FAILURE("Failed to run %s", programPath);
+        return false;
+    }
+    Sampler sampler;
+    sampler.frequency = frequency;
+    if (!sampler.attach(runner.getPid())) {
+        runner.stop();
+        return false;
+    }
+    INFO("Profiling %s", programPath);
+    runner.release();
+    while (runner.isRunning()) {
+        sampler.poll();
+        usleep(10 * 1000);
+    }
+    sampler.poll();
+    if (runner.exitStatus != 0) {
+        FAILURE("Profiled run of %s failed", programPath);
+    }
+    char foldedPath[maxPath];
+    addSuffix(programPath, ".folded", foldedPath);
+    sampler.report(20, foldedPath);
+    return runner.exitStatus == 0;
+}
+
+
+static int64_t loadInstructionCount(const char* path) {
+    Blob text;
+    if (!text.load(path)) {
+        return -1;
+    }
+    text.add("", 1);
+    return strtoll(text.data, nullptr, 10);
+}
+
+
+static bool saveInstructionCount(const char* path, int64_t count) {
+    char text[32];
+    Blob blob;
+    blob.add(text, sprintf(text, "%lld\n", (long long)count));
+    return blob.save(path);
+}
+
+
+// Instruction counts are kept next to the program, like bench results, as
+// "<program>.instructions" and "<program>.instructions.<name>". They hardly
+// change from run to run (ASLR is off), unlike time, so they can gate CI.
+bool Builder::count(const char* path, const char* configId, bool instructionsOnly, const BenchOptions& bench) {
+    options.skipExec = true;
+    programPath[0] = 0;
+    if (!build(path, configId)) {
+        return false;
+    }
+    if (!programPath[0]) {
+        FAILURE("Nothing to run, specify the program");
+        return false;
+    }
+    Runner runner;
+    runner.args.add(programPath);
+    if (options.runArgs) {
+        for (StringList::Iterator i(*options.runArgs); i; i.next()) {
+            runner.args.add(i->string, i->length);
+        }
+    }
+    runner.cpu = bench.cpu;
+    runner.noAslr = bench.noAslr || instructionsOnly;
+    runner.held = true;
+    if (!runner.start()) {
+        FAILURE("Failed to run %s", programPath);
+        return false;
+    }
+    Counters counters;
+    counters.instructionsOnly = instructionsOnly;
+    if (!counters.attach(runner.getPid())) {
+        runner.stop();
+        return false;
+    }
+    runner.release();
+    if (!runner.wait()) {
+        FAILURE("Failed to run %s", programPath);
+        return false;
+    }
+    counters.read();
+    if (runner.exitStatus != 0) {
+        FAILURE("Counted run of %s failed", programPath);
+        return false;
+    }
+    INFO("Counters of %s (user space):", programPath);
+    counters.print();
+    if (!instructionsOnly) {
+        return true;
+    }
+    int64_t instructions = counters.getInstructions();
+    if (instructions < 0) {
+        FAILURE("Instructions cannot be counted");
+        return false;
+    }
+    char resultsPath[maxPath];
+    addSuffix(programPath, ".instructions", resultsPath);
+    char baselinePath[maxPath * 2];
+    char baseName[maxPath];
+    int64_t base;
+    if (bench.baseline) {
+        snprintf(baselinePath, sizeof(baselinePath), "%s.%s", resultsPath, bench.baseline);
+        base = loadInstructionCount(baselinePath);
+        if (base < 0) {
+            FAILURE("No baseline %s for %s", bench.baseline, programPath);
+            return false;
+        }
+        snprintf(baseName, sizeof(baseName), "baseline %s", bench.baseline);
+    }
+    else {
+        base = loadInstructionCount(resultsPath);
+        strcpy(baseName, "previous run");
+    }
+    bool ok = true;
+    if (base > 0) {
+        double change = (double(instructions) / base - 1) * 100;
+        INFO("Against %s: %lld -> %lld instructions (%+.2f%%)", baseName, (long long)base, (long long)instructions, change);
+        if (bench.maxIncrease >= 0 && change > bench.maxIncrease) {
+            FAILURE("Instructions of %s increased by more than %g%%", programPath, bench.maxIncrease);
+            ok = false;
+        }
+    }
+    if (!saveInstructionCount(resultsPath, instructions)) {
+        FAILURE("Cannot save %s", resultsPath);
+        return false;
+    }
+    if (bench.saveBaseline) {
+        snprintf(baselinePath, sizeof(baselinePath), "%s.%s", resultsPath, bench.saveBaseline);
+        if (!saveInstructionCount(baselinePath, instructions)) {
+            FAILURE("Cannot save %s", baselinePath);
+            return false;
+        }
+        INFO("Saved as baseline %s", bench.saveBaseline);
+    }
+    return ok;
+}
+
+
+// Standard headers most snippets need, unless eval_prelude lists others.
+static const char* defaultEvalPrelude[] = {
+    "<cstdio>", "<cstdlib>", "<cstring>", "<cstdint>", "<cmath>", "<string>", "<vector>", "<map>",
+    "<unordered_map>", "<algorithm>", "<memory>", "<iostream>", "<chrono>", nullptr
+};
+
+
+// The snippet is the body of main(), after the prelude, which is precompiled
+// in the cache of the current unit. The unit is built first, the snippet is
+// linked with its libraries.
+bool Builder::eval(const char* snippet, const char* configId) {
+    options.skipLinking = true;
+    if (!build("", configId)) {
+        return false;
+    }
+    bool created;
+    if (!createCacheDir(created)) {
+        return false;
+    }
+    Blob prelude;
+    prelude.add("// Generated by cx for --eval, see eval_prelude.\n");
+    StringList headers;
+    if (config.evalPrelude.isEmpty()) {
+        for (const char** i = defaultEvalPrelude; *i; i++) {
+            headers.add(*i);
+        }
+    }
+    else {
+        headers = config.evalPrelude;
+    }
+    for (StringList::Iterator i(headers); i; i.next()) {
+        prelude.add("#include ");
+        if (i->string[0] == '<' || i->string[0] == '"') {
+            prelude.add(i->string, i->length);
+        }
+        else {
+            prelude.add("\"");
+            prelude.add(i->string, i->length);
+            prelude.add("\"");
+        }
+        prelude.add("\n");
+    }
+    char headerPath[maxPath];
+    char absHeaderPath[maxPath];
+    char pchPath[maxPath];
+    makeDerivedPath(profile->id, unitPath, "eval.prelude.h", "", headerPath);
+    rebase(headerPath, absHeaderPath);
+    addSuffix(headerPath, ".gch", pchPath);
+    {
+        char lockPath[maxPath];
+        FileLock lock(getLockPath(pchPath, lockPath));
+        Blob old;
+        if (!(old.load(absHeaderPath) && old.size == prelude.size && memcmp(old.data, prelude.data, prelude.size) == 0)) {
+            char pchDepsPath[maxPath];
+            char absPchDepsPath[maxPath];
+            deleteFile(rebase(addSuffix(pchPath, ".deps", pchDepsPath), absPchDepsPath));
+            if (!prelude.save(absHeaderPath)) {
+                FAILURE("Failed to write %s", absHeaderPath);
+                return false;
+            }
+        }
+        Dependencies deps;
+        if (options.force || !checkDeps(pchPath, profile->tag, config.cxxOptionsTag, 0, deps)) {
+            if (!compiler->precompile(config, headerPath, deps)) {
+                return false;
+            }
+        }
+    }
+    char name[64];
+    char sourcePath[maxPath];
+    char absSourcePath[maxPath];
+    char execPath[maxPath];
+    char absExecPath[maxPath];
+    sprintf(name, "eval.%d.cpp", int(getpid()));
+    makeDerivedPath(profile->id, unitPath, name, "", sourcePath);
+    rebase(sourcePath, absSourcePath);
+    rebase(addSuffix(sourcePath, ".exe", execPath), absExecPath);
+    // Includes in the snippet go before main(), blank lines are left instead.
+    Blob source;
+    Blob body;
+    source.add("#include \"eval.prelude.h\"\n");
+    int line = 1;
+    for (const char* p = snippet; *p; line++) {
+        const char* end = strchr(p, '\n');
+        int length = end ? end - p : strlen(p);
+        const char* text = p;
+        while (text < p + length && (*text == ' ' || *text == '\t')) {
+            text++;
+        }
+        if (strncmp(text, "#include", 8) == 0) {
+            char directive[64];
+            source.add(directive, sprintf(directive, "#line %d \"<eval>\"\n", line));
+            source.add(p, length);
+        }
+        else {
+            body.add(p, length);
+        }
+        source.add("\n", 1);
+        body.add("\n", 1);
+        p += end ? length + 1 : length;
+    }
+    source.add("int main(int argc, char** argv) {\n#line 1 \"<eval>\"\n");
+    source.add(body.data, body.size);
+    source.add(";\nreturn 0;\n}\n");
+    if (!source.save(absSourcePath)) {
+        FAILURE("Failed to write %s", absSourcePath);
+        return false;
+    }
+    StringList libs;
+    fillUnitLibList(libs); // With external libs, this unit's too.
+    bool ok = compiler->compileProgram(config, sourcePath, execPath, libs);
+    deleteFile(absSourcePath);
+    if (ok) {
+        Runner runner;
+        runner.args.add(absExecPath);
+        if (options.runArgs) {
+            for (StringList::Iterator i(*options.runArgs); i; i.next()) {
+                runner.args.add(i->string, i->length);
+            }
+        }
+        ok = runner.start() && runner.wait() && runner.exitStatus == 0;
+    }
+    deleteFile(absExecPath);
+    return ok;
+}
@@ -5,25 +5,52 @@
 #include "compiler.h"
 #include "config.h"
 #include "async.h"
+#include "runner.h"
+#include "history.h"
+#include "bench.h"
 #include <mutex>
+#include <atomic>
+
+struct BuilderJob;
+struct CompileJob;
 
 class Builder {
 public:
     struct Options {
         bool force = false;
         bool keepDeps = false;
+        bool timeReport = false; // Compile with compiler's time reports, print the summary.
+        bool impact = false; // Print rebuild impact of headers.
         bool skipRunning = false;
         bool skipLinking = false;
+        bool test = false;
+        bool watch = false;
+        bool keepGoing = false; // On errors, build what still can be built. Otherwise stop right away.
+        bool skipExec = false; // Link, but leave the program in programPath instead of running it.
+        Profile::Pgo pgo = Profile::pgoNone;
+        bool sampling = false; // See Profile::sampling.
+        const char* testFilter = nullptr; // Wildcard for test source names.
+        int testTimeout = 0; // Seconds.
         StringList* runArgs = nullptr;
     };
     Options options;
-    Builder() {};
+    Builder();
     Builder(const Builder&) = delete;
     Builder& operator=(const Builder&) = delete;
     ~Builder();
 
     bool build(const char* path, const char* configId = nullptr);
-    static bool clean(const char* path, const char* configId = nullptr);
+    bool test(const char* path, const char* configId = nullptr);
+    bool watch(const char* path, const char* configId = nullptr);
+    bool train(const char* path, const char* configId = nullptr);
+    bool bench(const char* path, const char* configId, const BenchOptions&);
+    bool sample(const char* path, const char* configId, int frequency); // Profile the program.
+    // Event counters of the program. With instructionsOnly, compared with the previous run, or the baseline.
+    bool count(const char* path, const char* configId, bool instructionsOnly, const BenchOptions&);
+    bool eval(const char* snippet, const char* configId = nullptr); // In the current directory.
+    bool clean(const char* path, const char* configId = nullptr);
+    bool collectGarbage(const char* path, const char* configId);
+    bool showHistory(const char* path, const char* configId, int builds);
 
 private:
 
@@ -31,37 +58,118 @@ private:
     Profile* profile = nullptr;
     Compiler* compiler = nullptr;
     Config config;
-    char topPath[maxPath];
     char unitPath[maxPath];
-    char sourceToRun[maxPath];
+    // Top level builder only, null in unit builders (there may be tens of thousands of those).
+    char* topPath = nullptr;
+    char* sourceToRun = nullptr;
+    char* programPath = nullptr; // What to run, in watch mode.
+    bool keepProfile = false;
     FileStateList sources;
 
+    // Unit build state.
+    bool skipDepsCheck = false;
+    bool anyRecompiled = false;
+    int pendingCount = 0; // Sources not compiled yet.
+    uint64_t objTag = 0;
+    StringList objList;
+    StringList objListMain;
+    StringList libList; // For linking, if there are mains.
+    uint64_t libsTag = 0;
+    FileStateList inputs; // Sources and headers used by unit objects, for run manifest.
+    bool prefetched = false; // Started before it was known to be used, see prefetchUnits().
+    StringList heldErrors; // Of a prefetched unit, printed once it turns out to be used.
+
+    // Top level builder only. It owns unit builders, and it's the only one
+    // sending and receiving jobs.
     Builder* master = this;
+    Builder* units = nullptr;
+    Builder* nextUnit = nullptr;
     std::mutex masterMutex;
-    FileStateDict unitDirDeps;
-    FileStateDict libDeps;
-    uint64_t libsTag;
+    FileStateDict unitDirDeps; // Tags are unitFlag* bits.
+    StringDict unitEdges; // "from\0to" pairs of unit paths.
+    StringDict unitLibDeps; // "unit\0lib" pairs, external libs per unit.
+    StringDict inputDirs; // Watch mode: directories of sources and headers used.
+    bool collectInputs = false; // For run manifest.
+
+    // Build time history and progress. Top level builder only.
+    std::mutex historyMutex;
+    BuildHistory history; // Loaded when the first target is rebuilt.
+    bool historyLoaded = false;
+    int64_t buildStartTime = 0;
+    std::atomic<int64_t> workEstimate{0}; // Targets being rebuilt right now, their expected durations...
+    std::atomic<int64_t> workStartSum{0}; // ...and start times.
+    std::atomic<int> workCount{0};
+    int sourceCount = 0; // Compile jobs sent.
+    int checkedCount = 0; // Compile jobs done.
+    int recompiledCount = 0;
+    int64_t lastProgressTime = 0;
 
     Batch batch;
+    friend struct ScanJob;
     friend struct CompileJob;
-    friend struct LibraryJob;
+    friend struct ArchiveJob;
+    friend struct LinkJob;
+    friend struct TestJob;
+    friend struct WorkScope;
 
     std::mutex fileStateCacheMutex;
     FileStateDict fileStateCache;
 
+    explicit Builder(Builder* master); // Unit builder.
     static const char* getConfigId(const char* configId);
     char* rebase(const char*, char*);
     uint64_t lookupFileTag(const char*);
     bool createCacheDir(bool& created);
-    bool checkDeps(const char*, uint32_t toolTag, uint32_t optTag, Dependencies&);
-    bool checkDeps(const char*, uint32_t toolTag, uint32_t optTag, uint64_t depsTag, uint8_t& flags);
+    bool checkDeps(const char*, uint64_t toolTag, uint64_t optTag, uint64_t inputsTag, Dependencies&);
+    bool checkDeps(const char*, uint64_t toolTag, uint64_t optTag, uint64_t depsTag, uint8_t& flags);
     bool scanDirectory();
+    void addScannedFile(FileType, const Directory::Entry&);
     bool processPath(const char*);
+    bool loadTopConfig(const char* configId);
     bool loadProfile(const char* configId);
     bool loadConfig(const char* configId);
+    bool isObjectFresh(const char* sourcePath, const char* objPath, uint64_t profileTag, Dependencies&);
+    char* getLockPath(const char* targetPath, char* absLockPath);
     bool updateSource(const char*, bool force, bool& recompiled, Dependencies&);
-    bool extractUnitDirDeps(Dependencies&);
-    void fillUnitLibList(StringList&);
-    bool buildPhase1(const char* path, const char* configId);
-    bool buildPhase2();
+    bool updateLibrary();
+    bool updateExecutable(const char* objPath, const StringList& libList, uint64_t libsTag);
+    void extractUnitDirDeps(Dependencies&);
+    void startUnit(const char* path, bool prefetched = false);
+    void markUnit(const char* path, uint64_t flags);
+    void collectUsedUnits(StringDict&, const char* root = nullptr);
+    bool checkUnitFailures(const char* root = nullptr);
+    void prefetchUnits();
+    void saveUnitGraph(const StringDict& used);
+    void releaseHeldErrors(const StringDict& used);
+    uint64_t fillUnitLibList(StringList&, const char* root = nullptr);
+    bool scanUnit();
+    void startCompiling();
+    void onSourceDone(CompileJob*);
+    bool onJobDone(BuilderJob*);
+    bool runJobs();
+    bool linkAndRun();
+    bool execProgram(const char* absExecPath);
+    char* getRunManifestPath(char* path);
+    void saveRunManifest(const char* absExecPath);
+    bool runCached();
+    bool finishBuild();
+    void reset();
+    void resetUnit();
+    bool refreshFileTags(const StringDict& changed);
+    bool rebuild(const StringList& changed);
+    bool collectGarbage(const char* dir);
+    void autoCollectGarbage();
+    char* getHistoryPath(char* path);
+    void loadHistory();
+    void saveHistory();
+    void showProgress();
+    void printTimeReport(const StringDict& used);
+    void printImpact(const StringDict& used);
+    void resetProfiles();
+    int publishProfiles(const char* useId);
+    void findUnits(const char* dir);
+    char* getTestSource(const char* objPath, char* absSourcePath);
+    bool isTest(const char* objPath);
+    uint64_t getTestTag(const char* execPath);
+    bool runTest(const char* execPath, Runner&);
 };
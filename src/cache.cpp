@@ -0,0 +1,353 @@
+#include "cache.h"
+#include "compiler.h"
+#include "async.h"
+#include "dirs.h"
+#include "output.h"
+
+#include <unistd.h>
+
+
+struct CacheJob: public Job {
+    char path[maxPath];
+    StringList subdirs;
+    // Remaining per configuration, for eviction.
+    FileStateList sizes;
+    FileStateList times;
+    uint64_t bytesFreed = 0;
+    int filesDeleted = 0;
+    CacheJob(const char* p) { strcpy(path, p); }
+    void run() override;
+    void collectConfig(const char* configPath, const char* configId, const StringDict& sources);
+};
+
+
+// Does the record of precompiled header "<header>.gch" still hold: do all the
+// files it was made from exist? If they only changed, it will be remade.
+static bool isPchValid(const char* header, const char* configPath, const char* unitPath) {
+    char depsName[maxPath];
+    char depsPath[maxPath];
+    catPath(configPath, addSuffix(header, ".gch.deps", depsName), depsPath);
+    Dependencies deps;
+    if (!deps.load(depsPath)) {
+        return false;
+    }
+    for (Dependencies::Iterator i(deps); i; i.next()) {
+        char absPath[maxPath];
+        if (!fileExists(rebasePath(unitPath, i->string, absPath))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Artifacts are named after their sources, like "x.cpp.o.exe.deps". Programs
+// (and their run manifests) are only kept while the object record says the
+// source defines main(). Precompiled headers, like "h.gch.deps", are kept
+// while their record holds. Others (library, listing, etc.) are per unit,
+// they are needed while it has sources.
+static bool isReferenced(const char* name, const StringDict& sources, const char* configPath, const char* unitPath) {
+    if (getFileType(name) == typeHeader) { // Generated, like the --eval prelude.
+        return isPchValid(name, configPath, unitPath);
+    }
+    char prefix[maxPath];
+    int length = strlen(name);
+    memcpy(prefix, name, length + 1);
+    for (int i = length - 1; i > 0; i--) {
+        if (prefix[i] == '.') {
+            prefix[i] = 0;
+            FileType type = getFileType(prefix);
+            if (type == typeHeader) {
+                return isPchValid(prefix, configPath, unitPath);
+            }
+            if (type == typeCSource || type == typeCppSource) {
+                if (!sources.find(prefix, i)) {
+                    return false;
+                }
+                const char* rest = name + i;
+                if (strncmp(rest, ".o.exe", 6) != 0 && strcmp(rest, ".manifest") != 0) {
+                    return true;
+                }
+                char objDepsName[maxPath];
+                char objDepsPath[maxPath];
+                catPath(configPath, addSuffix(prefix, ".o.deps", objDepsName), objDepsPath);
+                DepsHeader header;
+                return header.load(objDepsPath) && (header.flags & Compiler::flagHasMain);
+            }
+        }
+    }
+    return sources.getCount() != 0;
+}
+
+
+void CacheJob::collectConfig(const char* configPath, const char* configId, const StringDict& sources) {
+    Directory dir(configPath);
+    dir.hidden = true;
+    uint64_t size = 0;
+    int count = 0;
+    for (Directory::Entry entry; dir.read(entry); ) {
+        char entryPath[maxPath];
+        catPath(configPath, entry.name, entryPath);
+        if (entry.type == Directory::typeDirectory) {
+            // Not ours.
+            continue;
+        }
+        if (isReferenced(entry.name, sources, configPath, path)) {
+            size += entry.size;
+            count++;
+        }
+        else if (deleteFile(entryPath)) {
+            TRACE("Deleted %s", entryPath);
+            bytesFreed += entry.size;
+            filesDeleted++;
+        }
+    }
+    dir.close();
+    if (count == 0) {
+        rmdir(configPath);
+        return;
+    }
+    // Builder touches the directory each time it uses it.
+    int64_t time = getFileTime(configPath) / 1000000000;
+    char item[maxPath + maxConfigId];
+    int idLength = strlen(configId);
+    memcpy(item, configId, idLength + 1);
+    strcpy(item + idLength + 1, configPath);
+    int itemLength = idLength + 1 + strlen(configPath);
+    sizes.add(size, item, itemLength);
+    times.add(time, item, itemLength);
+}
+
+
+// With cache root, the mirror is walked, not the source tree. So caches of
+// deleted source directories are found too.
+void CacheJob::run() {
+    Directory dir(path);
+    StringDict sources;
+    for (Directory::Entry entry; dir.read(entry, false); ) {
+        if (entry.type == Directory::typeDirectory) {
+            if (!cacheRoot) {
+                char subdir[maxPath];
+                subdirs.add(catPath(path, entry.name, subdir));
+            }
+        }
+        else {
+            FileType type = getFileType(entry.name);
+            if (type == typeCSource || type == typeCppSource) {
+                StringDict::Entry* e;
+                sources.add(entry.name, e);
+            }
+        }
+    }
+    dir.close();
+    if (cacheRoot) {
+        char mirror[maxPath];
+        Directory mirrorDir(mirrorPath(path, mirror));
+        for (Directory::Entry entry; mirrorDir.read(entry, false); ) {
+            if (entry.type == Directory::typeDirectory) {
+                char subdir[maxPath];
+                subdirs.add(catPath(path, entry.name, subdir));
+            }
+        }
+    }
+    char cachePath[maxPath];
+    getCacheDirectory(path, cachePath);
+    Directory cache(cachePath);
+    if (!cache) {
+        return;
+    }
+    for (Directory::Entry entry; cache.read(entry, false); ) {
+        if (entry.type == Directory::typeDirectory) {
+            char configPath[maxPath];
+            collectConfig(catPath(cachePath, entry.name, configPath), entry.name, sources);
+        }
+    }
+    cache.close();
+    rmdir(cachePath); // Only if empty.
+}
+
+
+struct EvictJob: public Job {
+    char path[maxPath];
+    uint64_t bytesFreed = 0;
+    int filesDeleted = 0;
+    EvictJob(const char* p) { strcpy(path, p); }
+    void run() override {
+        removeDirectory(path, &bytesFreed, &filesDeleted);
+    }
+};
+
+
+bool CacheCollector::collect(const char* path) {
+    char mirror[maxPath];
+    if (!directoryExists(mirrorPath(path, mirror))) {
+        return true; // Nothing was built there.
+    }
+    Batch batch;
+    batch.send(new CacheJob(path));
+    while (Job* job = batch.receive()) {
+        CacheJob* cacheJob = static_cast<CacheJob*>(job);
+        for (StringList::Iterator i(cacheJob->subdirs); i; i.next()) {
+            batch.send(new CacheJob(i->string));
+        }
+        bytesFreed += cacheJob->bytesFreed;
+        filesDeleted += cacheJob->filesDeleted;
+        for (FileStateList::Iterator i(cacheJob->sizes); i; i.next()) {
+            configSizes.put(0, i->string)->tag += i->tag;
+            configDirs.add(i->string, i->length);
+        }
+        for (FileStateList::Iterator i(cacheJob->times); i; i.next()) {
+            FileStateDict::Entry* e = configTimes.put(0, i->string);
+            if (e->tag < i->tag) {
+                e->tag = i->tag;
+            }
+        }
+        delete job;
+    }
+    if (sizeLimit) {
+        evict();
+    }
+    return true;
+}
+
+
+void CacheCollector::evict() {
+    const uint64_t evicted = ~uint64_t(0);
+    uint64_t total = 0;
+    for (FileStateDict::Iterator i(configSizes); i; i.next()) {
+        total += i->tag;
+    }
+    while (total > sizeLimit) {
+        // Few configurations, so just pick the oldest each time.
+        const char* oldest = nullptr;
+        uint64_t oldestTime = 0;
+        for (FileStateDict::Iterator i(configTimes); i; i.next()) {
+            if (i->tag == evicted || (currentConfigId && strcmp(i->string, currentConfigId) == 0)) {
+                continue;
+            }
+            if (!oldest || i->tag < oldestTime) {
+                oldest = i->string;
+                oldestTime = i->tag;
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+        configTimes.find(oldest)->tag = evicted;
+        TRACE("Evicting configuration [%s]", oldest);
+        Batch batch;
+        for (StringList::Iterator i(configDirs); i; i.next()) {
+            if (strcmp(i->string, oldest) == 0) {
+                batch.send(new EvictJob(i->string + strlen(i->string) + 1));
+            }
+        }
+        while (Job* job = batch.receive()) {
+            EvictJob* evictJob = static_cast<EvictJob*>(job);
+            bytesFreed += evictJob->bytesFreed;
+            filesDeleted += evictJob->filesDeleted;
+            delete job;
+        }
+        total -= configSizes.find(oldest)->tag;
+    }
+}
+
+
+struct CleanJob: public Job {
+    char path[maxPath]; // Mirrored.
+    const char* configId;
+    StringList subdirs;
+    uint64_t bytesFreed = 0;
+    int filesDeleted = 0;
+    bool ok = true;
+    CleanJob(const char* p, const char* id): configId(id) { strcpy(path, p); }
+    void run() override;
+};
+
+
+static bool isConfigDirectory(const char* name, const char* configId) {
+    int length = strlen(configId);
+    return strncmp(name, configId, length) == 0 &&
+        (name[length] == 0 || strncmp(name + length, ".pgo", 4) == 0 || strcmp(name + length, ".prof") == 0);
+}
+
+
+// Hidden directories, like caches themselves or .git, are not walked. Other
+// directories may have units anywhere below them: nothing records every
+// directory built in (unit graphs only list units used by the one built), so
+// pruning more could leave caches behind. With cache root, only the mirror
+// is walked, it has nothing but directories built in.
+void CleanJob::run() {
+    Directory dir(path);
+    for (Directory::Entry entry; dir.read(entry, false); ) {
+        if (entry.type == Directory::typeDirectory) {
+            char subdir[maxPath];
+            subdirs.add(catPath(path, entry.name, subdir));
+        }
+    }
+    dir.close();
+    char cachePath[maxPath];
+    catPath(path, cacheDirName, cachePath);
+    if (!configId) {
+        if (directoryExists(cachePath)) {
+            TRACE("Deleting %s", cachePath);
+            ok = removeDirectory(cachePath, &bytesFreed, &filesDeleted);
+        }
+        return;
+    }
+    Directory cache(cachePath);
+    if (!cache) {
+        return;
+    }
+    for (Directory::Entry entry; cache.read(entry, false); ) {
+        if (entry.type == Directory::typeDirectory && isConfigDirectory(entry.name, configId)) {
+            char configPath[maxPath];
+            catPath(cachePath, entry.name, configPath);
+            TRACE("Deleting %s", configPath);
+            ok = removeDirectory(configPath, &bytesFreed, &filesDeleted) && ok;
+        }
+    }
+    cache.close();
+}
+
+
+bool CacheCleaner::clean(const char* path) {
+    char mirror[maxPath];
+    if (!directoryExists(mirrorPath(path, mirror))) {
+        return true; // Nothing was built there.
+    }
+    bool ok = true;
+    Batch batch;
+    batch.send(new CleanJob(mirror, configId));
+    while (Job* job = batch.receive()) {
+        CleanJob* cleanJob = static_cast<CleanJob*>(job);
+        for (StringList::Iterator i(cleanJob->subdirs); i; i.next()) {
+            batch.send(new CleanJob(i->string, configId));
+        }
+        bytesFreed += cleanJob->bytesFreed;
+        filesDeleted += cleanJob->filesDeleted;
+        if (!cleanJob->ok) {
+            FAILURE("Cannot delete everything in %s", cleanJob->path);
+            ok = false;
+        }
+        delete job;
+    }
+    return ok;
+}
+
+
+char* formatSize(uint64_t bytes, char* text) {
+    static const char* units[] = {"bytes", "KB", "MB", "GB", "TB"};
+    double size = double(bytes);
+    int unit = 0;
+    while (size >= 1024 && unit < 4) {
+        size /= 1024;
+        unit++;
+    }
+    if (unit == 0) {
+        sprintf(text, "%d %s", int(bytes), units[0]);
+    }
+    else {
+        sprintf(text, "%.1f %s", size, units[unit]);
+    }
+    return text;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "lists.h"
+
+// Garbage collection of build artifacts in a directory tree. First deletes
+// artifacts of sources which no longer exist (and caches of directories with
+// no sources at all), then, if there is a size limit, whole configurations,
+// least recently used first. Directories are processed in parallel.
+class CacheCollector {
+public:
+    const char* currentConfigId = nullptr; // Never evicted.
+    uint64_t sizeLimit = 0; // Bytes. No limit if 0.
+    uint64_t bytesFreed = 0;
+    int filesDeleted = 0;
+    bool collect(const char* path);
+
+private:
+    // Per configuration id.
+    FileStateDict configSizes;
+    FileStateDict configTimes; // Most recent use, seconds.
+    StringList configDirs; // "config\0path" pairs.
+    void evict();
+};
+
+// Deletion of build artifacts in a directory tree (see --clean). Walks the
+// cache mirror, if there is cache root, so only what was built. Directories
+// are processed in parallel.
+class CacheCleaner {
+public:
+    const char* configId = nullptr; // With its PGO and profiling variants. All configurations if null.
+    uint64_t bytesFreed = 0;
+    int filesDeleted = 0;
+    bool clean(const char* path);
+};
+
+char* formatSize(uint64_t bytes, char* text); // Like "1.5 MB".
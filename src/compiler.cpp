@@ -4,8 +4,11 @@
 #include "hash.h"
 #include "output.h"
 #include <cstring>
+#include <cstdio>
+#include <unistd.h>
 
 const char* cacheDirName = ".cx.cache";
+const char* cacheRoot = nullptr;
 
 
 FileType getFileType(const char* path) {
@@ -70,36 +73,74 @@ FileType getFileType(const char* path) {
 }
 
 
-char* makeDerivedPath(const char* configId, const char* source, const char* suffix, char* derived) {
+void setCacheRoot(const char* path) {
+    static char root[maxPath];
+    if (path && *path) {
+        normalizePath(path, root);
+        cacheRoot = root;
+        TRACE("Cache root: %s", cacheRoot);
+    }
+    else {
+        cacheRoot = nullptr;
+    }
+}
+
+
+// Absolute paths are appended to the root as is, so the root mirrors the whole tree.
+char* mirrorPath(const char* dir, char* path) {
+    if (!cacheRoot) {
+        strcpy(path, dir);
+        return path;
+    }
+    char temp[maxPath];
+    while (*dir == '/') {
+        dir++;
+    }
+    return normalizePath(catPath(cacheRoot, dir, temp), path);
+}
+
+
+char* getCacheDirectory(const char* dir, char* path) {
+    char mirror[maxPath];
+    return catPath(mirrorPath(dir, mirror), cacheDirName, path);
+}
+
+
+// Source path is relative to the unit, or absolute. So is the result,
+// unless there is cache root, then the result is always absolute.
+char* makeDerivedPath(const char* configId, const char* unitPath, const char* source, const char* suffix, char* derived) {
     const char* lastSlash = nullptr;
     const char* p = source;
-    char temp[maxPath];
     for ( ; *p; p++) {
         if (*p == '/') {
             lastSlash = p;
         }
     }
-    int pos = 0;
+    char dir[maxPath];
+    dir[0] = 0;
+    const char* name = source;
     if (lastSlash) {
-        pos = lastSlash + 1 - source;
-        memcpy(temp, source, pos);
+        memcpy(dir, source, lastSlash + 1 - source);
+        dir[lastSlash + 1 - source] = 0;
+        name = lastSlash + 1;
     }
-    int len = strlen(cacheDirName);
-    memcpy(temp + pos, cacheDirName, len);
-    pos += len;
+    char temp[maxPath];
+    if (cacheRoot) {
+        char absDir[maxPath];
+        getCacheDirectory(rebasePath(unitPath, dir, absDir), temp);
+    }
+    else {
+        catPath(dir, cacheDirName, temp);
+    }
+    int pos = strlen(temp);
+    int len = strlen(configId);
     temp[pos++] = '/';
-    len = strlen(configId);
     memcpy(temp + pos, configId, len);
     pos += len;
     temp[pos++] = '/';
-    if (lastSlash) {
-        memcpy(temp + pos, lastSlash + 1, p - lastSlash - 1);
-        pos += p - lastSlash - 1;
-    }
-    else {
-        memcpy(temp + pos, source, p - source);
-        pos += p - source;
-    }
+    len = p - name;
+    memcpy(temp + pos, name, len);
+    pos += len;
     strcpy(temp + pos, suffix);
     return normalizePath(temp, derived);
 }
@@ -117,9 +158,9 @@ GccCompiler::GccCompiler(Profile& p): Compiler(p) {
         if (i->length + 1 <= sizeof(profile.version)) {
             memcpy(profile.version, i->string, i->length + 1);
             TRACE("%s", profile.version);
-            uint32_t versionHash = hash(i->string, i->length);
+            uint64_t versionHash = hash64(i->string, i->length);
             profile.init();
-            profile.tag += versionHash;
+            profile.tag = combineHash(profile.tag, versionHash);
             return;
         }
     }
@@ -127,7 +168,7 @@ GccCompiler::GccCompiler(Profile& p): Compiler(p) {
 }
 
 
-static void skipGccDepSpaces(const char*& p) {
+static void skipGccDepSpaces(char*& p) {
    for (;;) {
        if (*p == ' ' || *p == '\t') {
            p++;
@@ -157,9 +198,12 @@ static void skipGccDepSpaces(const char*& p) {
 }
 
 
-static bool parseGccDepPath(const char*& p, char* name, int& length) {
+// Paths are returned in place, not zero-terminated. Escaped spaces are
+// unescaped in place, which only moves the rest of the path back.
+bool parseGccDepPath(char*& p, const char*& name, int& length) {
    skipGccDepSpaces(p);
-   length = 0;
+   name = p;
+   char* out = p;
    for (;;) {
        if (*p == 0 || *p == ' ' || *p == '\r' || *p == '\n' || *p == ':') {
            break;
@@ -169,39 +213,37 @@ static bool parseGccDepPath(const char*& p, char* name, int& length) {
                p++;
            }
        }
-       name[length++] = *p++;
-       if (length >= maxPath - 1) {
-           return false;
-       }
+       *out++ = *p++;
    }
-   name[length] = 0;
-   return length != 0;
+   length = out - name;
+   return length != 0 && length < maxPath;
 }
 
 
+// Make dependency rule comes from the compiler through a pipe, not a file.
 bool GccCompiler::convertGccDeps(
     const char* unitPath,
+    Blob& source,
     const char* gccDepsPath,
     const char* depsPath,
     bool hasMain,
-    uint32_t optTag,
+    uint64_t optTag,
+    uint64_t inputsTag,
     Dependencies& deps
 ) {
     char absGccDepsPath[maxPath];
     char absDepsPath[maxPath];
     rebasePath(unitPath, gccDepsPath, absGccDepsPath);
     rebasePath(unitPath, depsPath, absDepsPath);
-    Blob source;
-    if (!source.load(absGccDepsPath)) {
-        FAILURE("Compiler is expected to produce %s file", absGccDepsPath);
-        deleteFile(absDepsPath);
-        return false;
+    if (keepDeps) {
+        source.save(absGccDepsPath);
     }
-    const char* p = source.data;
-    char name[maxPath];
+    source.add("", 1);
+    char* p = source.data;
+    const char* name;
     int length;
     if (!parseGccDepPath(p, name, length) || (skipGccDepSpaces(p), *p != ':')) {
-        FAILURE("Bad format of %s make dependency file", absGccDepsPath);
+        FAILURE("Bad format of make dependencies of %s", absDepsPath);
         deleteFile(absDepsPath);
         return false;
     }
@@ -209,16 +251,13 @@ bool GccCompiler::convertGccDeps(
     deps.clear();
     while (parseGccDepPath(p, name, length)) {
         char absName[maxPath];
-        rebasePath(unitPath, name, absName);
+        rebasePath(unitPath, name, length, absName);
         deps.add(makeFileTag(absName), name, length);
     }
-    if (!keepDeps) {
-        deleteFile(absGccDepsPath);
-    }
     DepsHeader& header = deps.getHeader();
     header.toolTag = profile.tag;
     header.optTag = optTag,
-    header.inputsTag = 0;
+    header.inputsTag = inputsTag;
     header.flags = 0;
     if (hasMain) {
         header.flags |= flagHasMain;
@@ -241,21 +280,10 @@ static const char* colorOption() {
 }
 
 
-bool GccCompiler::compile(const Config& config, const char* sourcePath, Dependencies& deps) {
-    char absSourcePath[maxPath];
-    INFO("%s", rebasePath(config.path, sourcePath, absSourcePath));
-    char objPath[maxPath];
-    char gccDepsPath[maxPath];
-    char depsPath[maxPath];
-    makeDerivedPath(profile.id, sourcePath, ".o", objPath);
-    makeDerivedPath(profile.id, sourcePath, ".d", gccDepsPath);
-    addSuffix(objPath, ".deps", depsPath);
-    Runner runner;
-    runner.currentDirectory = config.path;
-    FileType type = getFileType(sourcePath);
+// Compiler, search path and options, common to everything compiled in the unit.
+bool GccCompiler::addCompileArgs(const Config& config, FileType type, Runner& runner) {
     runner.args.add(type == typeCppSource ? profile.cxx : profile.c);
     runner.args.add(colorOption());
-    runner.args.add("-MMD"); // -MD
     for (StringList::Iterator i(config.includeSearchPath); i; i.next()) {
         char inc[maxPath + 16];
         int len = sprintf(inc, "-I%s", i->string);
@@ -273,20 +301,89 @@ bool GccCompiler::compile(const Config& config, const char* sourcePath, Dependen
         if (!isValidGccOption(i->string, i->length)) return false;
         runner.args.add(i->string, i->length);
     }
+    switch (profile.pgo) {
+        case Profile::pgoGenerate:
+            runner.args.add("-fprofile-generate");
+            runner.args.add("-fprofile-update=prefer-atomic");
+            break;
+        case Profile::pgoUse:
+            runner.args.add("-fprofile-use");
+            runner.args.add("-fprofile-correction");
+            // Sources changed after training, or not executed by it.
+            runner.args.add("-Wno-coverage-mismatch");
+            runner.args.add("-Wno-missing-profile");
+            break;
+        default:
+            break;
+    }
+    if (profile.sampling) {
+        // Call stacks are walked by the kernel, following frame pointers.
+        runner.args.add("-g");
+        runner.args.add("-fno-omit-frame-pointer");
+    }
+    return true;
+}
+
+
+bool GccCompiler::compile(const Config& config, const char* sourcePath, Dependencies& deps) {
+    char absSourcePath[maxPath];
+    rebasePath(config.path, sourcePath, absSourcePath);
+    INFO("%s", absSourcePath);
+    char objPath[maxPath];
+    char gccDepsPath[maxPath];
+    char depsPath[maxPath];
+    makeDerivedPath(profile.id, config.path, sourcePath, ".o", objPath);
+    makeDerivedPath(profile.id, config.path, sourcePath, ".d", gccDepsPath);
+    addSuffix(objPath, ".deps", depsPath);
+    char timeReportPath[maxPath];
+    char absTimeReportPath[maxPath];
+    makeDerivedPath(profile.id, config.path, sourcePath, ".time", timeReportPath);
+    rebasePath(config.path, timeReportPath, absTimeReportPath);
+    bool isClang = strstr(profile.version, "clang") != nullptr;
+    uint64_t profileTag = 0;
+    if (profile.pgo == Profile::pgoUse) {
+        // GCC finds it by object path. Its tag goes to the header, so changed
+        // profile data causes recompilation.
+        char profilePath[maxPath];
+        char absProfilePath[maxPath];
+        makeDerivedPath(profile.id, config.path, sourcePath, ".gcda", profilePath);
+        profileTag = makeFileTag(rebasePath(config.path, profilePath, absProfilePath));
+    }
+    Runner runner;
+    runner.currentDirectory = config.path;
+    FileType type = getFileType(sourcePath);
+    if (!addCompileArgs(config, type, runner)) {
+        return false;
+    }
+    runner.args.add("-MMD"); // -MD
+    runner.args.add("-MF");
+    runner.args.add("/dev/fd/3");
+    runner.sideOutputFd = 3;
+    if (timeReport) {
+        runner.args.add(isClang ? "-ftime-trace" : "-ftime-report");
+    }
+    else {
+        deleteFile(absTimeReportPath); // Would be stale.
+    }
     runner.args.add("-c");
     runner.args.add(sourcePath);
     runner.args.add("-o");
     runner.args.add(objPath);
     if (runner.run()) {
         if (runner.exitStatus == 0) {
+            if (timeReport) {
+                saveTimeReport(config, objPath, absTimeReportPath, runner.output, isClang);
+            }
             printOutput(runner.output);
             bool hasMain = containsMain(config, objPath);
             return convertGccDeps(
                 config.path,
+                runner.sideOutput,
                 gccDepsPath,
                 depsPath,
                 hasMain,
                 getCompilerOptionsTag(config, type),
+                profileTag,
                 deps
             );
         }
@@ -299,6 +396,114 @@ bool GccCompiler::compile(const Config& config, const char* sourcePath, Dependen
 }
 
 
+// Precompiled C++ header, "<header>.gch", next to the header. Used by the
+// compiler instead of the header, if included first, with the same options.
+bool GccCompiler::precompile(const Config& config, const char* headerPath, Dependencies& deps) {
+    char absHeaderPath[maxPath];
+    rebasePath(config.path, headerPath, absHeaderPath);
+    INFO("%s", absHeaderPath);
+    char pchPath[maxPath];
+    char gccDepsPath[maxPath];
+    char depsPath[maxPath];
+    addSuffix(headerPath, ".gch", pchPath);
+    addSuffix(headerPath, ".d", gccDepsPath);
+    addSuffix(pchPath, ".deps", depsPath);
+    Runner runner;
+    runner.currentDirectory = config.path;
+    if (!addCompileArgs(config, typeCppSource, runner)) {
+        return false;
+    }
+    runner.args.add("-MMD");
+    runner.args.add("-MF");
+    runner.args.add("/dev/fd/3");
+    runner.sideOutputFd = 3;
+    runner.args.add("-x");
+    runner.args.add("c++-header");
+    runner.args.add(headerPath);
+    runner.args.add("-o");
+    runner.args.add(pchPath);
+    if (runner.run()) {
+        if (runner.exitStatus == 0) {
+            printOutput(runner.output);
+            return convertGccDeps(config.path, runner.sideOutput, gccDepsPath, depsPath, false, config.cxxOptionsTag, 0, deps);
+        }
+        delayedError("While precompiling %s%s%s", em, absHeaderPath, noem);
+        delayedError(runner.output);
+    }
+    return false;
+}
+
+
+bool GccCompiler::compileProgram(const Config& config, const char* sourcePath, const char* execPath, const StringList& libList) {
+    Runner runner;
+    runner.currentDirectory = config.path;
+    if (!addCompileArgs(config, getFileType(sourcePath), runner)) {
+        return false;
+    }
+    runner.args.add("-I.");
+    for (StringList::Iterator i(config.linkerOptions); i; i.next()) {
+        if (!isValidGccOption(i->string, i->length)) return false;
+        runner.args.add(i->string, i->length);
+    }
+    runner.args.add(sourcePath);
+    runner.args.add("-o");
+    runner.args.add(execPath);
+    if (!libList.isEmpty()) {
+        runner.args.add("-Wl,--start-group");
+        for (StringList::Iterator i(libList); i; i.next()) {
+            runner.args.add(i->string, i->length);
+        }
+        runner.args.add("-Wl,--end-group");
+    }
+    runner.args.add("-lpthread");
+    if (runner.run()) {
+        if (runner.exitStatus == 0) {
+            printOutput(runner.output);
+            return true;
+        }
+        delayedError(runner.output);
+    }
+    return false;
+}
+
+
+// GCC prints its report along with warnings, it's moved from the output to
+// the file. Clang writes JSON next to the object file, ".json" instead of ".o".
+void GccCompiler::saveTimeReport(const Config& config, const char* objPath, const char* reportPath, StringList& output, bool isClang) {
+    if (isClang) {
+        char tracePath[maxPath];
+        char absTracePath[maxPath];
+        strcpy(tracePath, objPath);
+        int length = strlen(tracePath);
+        if (length > 2 && strcmp(tracePath + length - 2, ".o") == 0) {
+            strcpy(tracePath + length - 2, ".json");
+            rename(rebasePath(config.path, tracePath, absTracePath), reportPath);
+        }
+        return;
+    }
+    Blob report;
+    StringList rest;
+    bool inReport = false;
+    for (StringList::Iterator i(output); i; i.next()) {
+        if (!inReport && strncmp(i->string, "Time variable", 13) == 0) {
+            inReport = true;
+        }
+        if (inReport) {
+            report.add(i->string, i->length);
+            report.add("\n", 1);
+            if (strncmp(i->string, " TOTAL", 6) == 0) {
+                inReport = false;
+            }
+        }
+        else if (i->length > 0) { // The report is preceded by an empty line.
+            rest.add(i->string, i->length);
+        }
+    }
+    report.save(reportPath);
+    output = rest;
+}
+
+
 bool GccCompiler::containsMain(const Config& config, const char* objPath) {
     Runner runner;
     runner.currentDirectory = config.path;
@@ -331,7 +536,8 @@ bool GccCompiler::containsMain(const Config& config, const char* objPath) {
 
 bool GccCompiler::link(const Config& config, const char* execPath, const StringList& objList, const StringList& libList) {
     char absExecPath[maxPath];
-    INFO("%s", rebasePath(config.path, execPath, absExecPath));
+    rebasePath(config.path, execPath, absExecPath);
+    INFO("%s", absExecPath);
     Runner runner;
     runner.currentDirectory = config.path;
     runner.args.add(profile.linker);
@@ -340,6 +546,9 @@ bool GccCompiler::link(const Config& config, const char* execPath, const StringL
         if (!isValidGccOption(i->string, i->length)) return false;
         runner.args.add(i->string, i->length);
     }
+    if (profile.pgo == Profile::pgoGenerate) {
+        runner.args.add("-fprofile-generate");
+    }
     runner.args.add("-o");
     runner.args.add(execPath);
     for (StringList::Iterator i(objList); i; i.next()) {
@@ -366,26 +575,32 @@ bool GccCompiler::link(const Config& config, const char* execPath, const StringL
 }
 
 
+// Made under a temporary name, then renamed, so that another cx linking with
+// the library meanwhile sees either the old one or the new one.
 bool GccCompiler::makeLibrary(const Config& config, const char* libPath, const StringList& objList) {
     char absLibPath[maxPath];
-    INFO("%s", rebasePath(config.path, libPath, absLibPath));
-    deleteFile(absLibPath);
+    rebasePath(config.path, libPath, absLibPath);
+    INFO("%s", absLibPath);
+    char tempPath[maxPath + 32];
+    snprintf(tempPath, sizeof(tempPath), "%s.%d.tmp", absLibPath, int(getpid()));
+    deleteFile(tempPath);
     Runner runner;
     runner.currentDirectory = config.path;
     runner.args.add(profile.librarian);
     runner.args.add("crs");
-    runner.args.add(libPath);
+    runner.args.add(tempPath);
     for (StringList::Iterator i(objList); i; i.next()) {
         runner.args.add(i->string, i->length);
     }
     if (runner.run()) {
-        if (runner.exitStatus == 0) {
+        if (runner.exitStatus == 0 && rename(tempPath, absLibPath) == 0) {
             printOutput(runner.output);
             return true;
         }
         delayedError("While packaging %s%s%s", em, absLibPath, noem);
         delayedError(runner.output);
     }
+    deleteFile(tempPath);
     deleteFile(absLibPath);
     return false;
 }
@@ -4,6 +4,8 @@
 #include "dirs.h"
 #include "config.h"
 
+class Runner;
+
 enum FileType {
     typeUnknown,
     typeHeader,
@@ -12,8 +14,13 @@ enum FileType {
 };
 
 extern const char* cacheDirName;
+extern const char* cacheRoot; // If set, artifacts go there instead of the source tree.
+void setCacheRoot(const char*);
+char* mirrorPath(const char* dir, char* path); // Where 'dir' is mirrored under cache root (or itself).
+char* getCacheDirectory(const char* dir, char* path); // For sources in 'dir', all configurations.
 FileType getFileType(const char* path);
-char* makeDerivedPath(const char* configId, const char* source, const char* suffix, char* derived);
+char* makeDerivedPath(const char* configId, const char* unitPath, const char* source, const char* suffix, char* derived);
+bool parseGccDepPath(char*& p, const char*& name, int& length); // Next path of make dependency rule.
 
 
 class Compiler {
@@ -22,15 +29,20 @@ public:
         flagHasMain = 1,
     };
     bool keepDeps = false;
+    bool timeReport = false; // Save compiler's time report of each source, see TimeReport.
     Profile& profile;
     Compiler(Profile& p): profile(p) {}
     virtual ~Compiler();
-    uint32_t getCompilerOptionsTag(const Config& config, FileType type) const { return type == typeCppSource ? config.cxxOptionsTag : type == typeCSource ? config.cOptionsTag : 0; }
-    uint32_t getCompilerOptionsTag(const Config& config, const char* path) const { return getCompilerOptionsTag(config, getFileType(path)); }
+    uint64_t getCompilerOptionsTag(const Config& config, FileType type) const { return type == typeCppSource ? config.cxxOptionsTag : type == typeCSource ? config.cOptionsTag : 0; }
+    uint64_t getCompilerOptionsTag(const Config& config, const char* path) const { return getCompilerOptionsTag(config, getFileType(path)); }
     virtual bool compile(const Config&, const char* sourcePath, Dependencies&) = 0;
     virtual bool link(const Config&, const char* exec, const StringList& objList, const StringList& libList) = 0;
     virtual bool makeLibrary(const Config&, const char* name, const StringList& objList) = 0;
     virtual bool containsMain(const Config&, const char* objPath) = 0;
+    // C++ header, into "<header>.gch", with dependencies like compile().
+    virtual bool precompile(const Config&, const char* headerPath, Dependencies&) = 0;
+    // Source straight to executable, nothing is kept but the executable.
+    virtual bool compileProgram(const Config&, const char* sourcePath, const char* exec, const StringList& libList) = 0;
 };
 
 
@@ -41,8 +53,12 @@ public:
     bool link(const Config&, const char* exec, const StringList& objList, const StringList& libList) override;
     bool makeLibrary(const Config&, const char* name, const StringList& objList) override;
     bool containsMain(const Config&, const char* objPath) override;
+    bool precompile(const Config&, const char* headerPath, Dependencies&) override;
+    bool compileProgram(const Config&, const char* sourcePath, const char* exec, const StringList& libList) override;
 protected:
-    bool convertGccDeps(const char*, const char*, const char*, bool, uint32_t, Dependencies&);
+    bool addCompileArgs(const Config&, FileType, Runner&);
+    void saveTimeReport(const Config&, const char* objPath, const char* reportPath, StringList& output, bool isClang);
+    bool convertGccDeps(const char*, Blob&, const char*, const char*, bool, uint64_t, uint64_t, Dependencies&);
 };
 
 
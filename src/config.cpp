@@ -5,17 +5,20 @@
 #include "dirs.h"
 
 #include <cstring>
+#include <cstdlib>
 
 
 Profile::Profile() {
     commonConfig.profile = this;
     strcpy(id, "default");
+    strcpy(configId, "default");
     strcpy(version, "unknown");
     strcpy(c, "gcc");
     strcpy(cxx, "g++");
     strcpy(linker, "g++");
     strcpy(librarian, "ar");
     strcpy(symList, "nm");
+    cacheRoot[0] = 0;
 }
 
 
@@ -25,7 +28,7 @@ void Profile::init() {
     if (!*linker) PANIC("Linker path cannot be empty"); 
     if (!*librarian) PANIC("Librarian path cannot be empty"); 
     if (!*symList) PANIC("Symbol list (nm) path cannot be empty"); 
-    tag = hash(c) + hash(cxx);
+    tag = combineHash(hash64(c), hash64(cxx));
 }
 
 
@@ -228,6 +231,23 @@ static bool parseList(const char* path, int& line, const char*& p, StringList& l
 }
 
 
+// Bytes, with optional K, M or G suffix.
+static bool parseSize(const char* text, uint64_t& size) {
+    char* end;
+    double value = strtod(text, &end);
+    switch (*end) {
+        case 'k': case 'K': value *= 1024; end++; break;
+        case 'm': case 'M': value *= 1024 * 1024; end++; break;
+        case 'g': case 'G': value *= 1024 * 1024 * 1024; end++; break;
+    }
+    if (end == text || *end || value < 0) {
+        return false;
+    }
+    size = uint64_t(value);
+    return true;
+}
+
+
 static bool parseValue(const char* path, int& line, const char*& p, char* value, int& length) {
     bool error;
     return
@@ -319,6 +339,26 @@ bool Config::parse(const char* path, const char* text, const char* configId) {
                 else if (parseId(p, "cxx_options", 11)) {
                     PARSE_LIST(compilerCppOptions);
                 }
+                else if (parseId(p, "cache_root", 10)) {
+                    PROFILE_ONLY;
+                    char value[maxPath];
+                    PARSE_VALUE(value);
+                    if (!ignoring) {
+                        char dir[maxPath];
+                        char name[maxPath];
+                        splitPath(path, dir, name);
+                        rebasePath(dir, value, profile->cacheRoot);
+                    }
+                }
+                else if (parseId(p, "cache_limit", 11)) {
+                    PROFILE_ONLY;
+                    char value[maxPath];
+                    PARSE_VALUE(value);
+                    if (!ignoring && !parseSize(value, profile->cacheLimit)) {
+                        FAILURE("%s:%d: Expected size, like 500M or 2G", path, line);
+                        goto error;
+                    }
+                }
                 else {
                     goto other;
                 }
@@ -375,10 +415,31 @@ bool Config::parse(const char* path, const char* text, const char* configId) {
                     goto other;
                 }
                 break;
+            case 't':
+                if (parseId(p, "test_data", 9)) {
+                    StringList temp;
+                    PARSE_LIST(temp);
+                    char dir[maxPath];
+                    char name[maxPath];
+                    splitPath(path, dir, name);
+                    char absDataPath[maxPath];
+                    for (StringList::Iterator i(temp); i; i.next()) {
+                        if (!ignoring) {
+                            testData.add(rebasePath(dir, i->string, absDataPath));
+                        }
+                    }
+                }
+                else {
+                    goto other;
+                }
+                break;
             case 'e':
                 if (parseId(p, "external_libs", 13)) {
                     PARSE_LIST(externalLibs);
                 }
+                else if (parseId(p, "eval_prelude", 12)) {
+                    PARSE_LIST(evalPrelude);
+                }
                 else {
                     goto other;
                 }
@@ -406,10 +467,10 @@ not_profile:
 
 
 void Config::afterParse() {
-    uint32_t compTag = getStringListHash(compilerOptions);
-    cOptionsTag = compTag + getStringListHash(compilerCOptions);
-    cxxOptionsTag = compTag + getStringListHash(compilerCppOptions);
-    linkerOptionsTag = getStringListHash(linkerOptions) + getStringListHash(externalLibs);
+    uint64_t compTag = combineHash(getStringListHash(includeSearchPath), getStringListHash(compilerOptions));
+    cOptionsTag = combineHash(compTag, getStringListHash(compilerCOptions));
+    cxxOptionsTag = combineHash(compTag, getStringListHash(compilerCppOptions));
+    linkerOptionsTag = combineHash(getStringListHash(linkerOptions), getStringListHash(externalLibs));
 }
 
 
@@ -14,9 +14,11 @@ struct Config {
     StringList linkerOptions;
     StringList externalLibs;
     StringList includeSearchPath;
-    uint32_t cOptionsTag;
-    uint32_t cxxOptionsTag;
-    uint32_t linkerOptionsTag;
+    StringList testData;
+    StringList evalPrelude; // Headers, for --eval.
+    uint64_t cOptionsTag; // Including include search path.
+    uint64_t cxxOptionsTag;
+    uint64_t linkerOptionsTag;
     bool load(const char* path, const char* configId = "default");
     bool parse(const char* path, const char* text, const char* configId = "default");
 private:
@@ -26,14 +28,28 @@ private:
 static constexpr int maxConfigId = 32;
 
 struct Profile {
-    uint32_t tag;
-    char id[maxConfigId];
+    // Profile guided optimization variant of the configuration.
+    // Each variant has its own cache directory, "<config>.pgo-gen" and "<config>.pgo".
+    enum Pgo {
+        pgoNone,
+        pgoGenerate, // Instrumented.
+        pgoUse, // Optimized using profile data of the instrumented variant.
+    };
+    uint64_t tag;
+    char id[maxConfigId + 16]; // Cache directory name, configId with variant suffixes.
+    char configId[maxConfigId]; // Section name in cx.top and cx.unit.
+    Pgo pgo = pgoNone;
+    // Built for the sampling profiler (--profile), with frame pointers and
+    // debug info. Cache directory "<config>.prof".
+    bool sampling = false;
     char version[128];
     char c[maxPath];
     char cxx[maxPath];
     char linker[maxPath];
     char librarian[maxPath];
     char symList[maxPath];
+    uint64_t cacheLimit = 0; // Bytes, for all configurations. No limit if 0.
+    char cacheRoot[maxPath]; // Out of tree cache. None if empty.
     Config commonConfig;
     Profile();
     void init();
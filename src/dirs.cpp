@@ -3,8 +3,13 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
 #include <dirent.h>
+#include <ctime>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 
@@ -31,10 +36,83 @@ bool makeDirectory(const char* path) {
     return mkdir(path, 0777) == 0;
 }
 
+bool makeDirectories(const char* path) {
+    if (directoryExists(path)) {
+        return true;
+    }
+    char parent[maxPath];
+    int length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') {
+        length--;
+    }
+    while (length > 0 && path[length - 1] != '/') {
+        length--;
+    }
+    memcpy(parent, path, length);
+    parent[length] = 0;
+    if (length > 1 && !makeDirectories(parent)) {
+        return false;
+    }
+    return makeDirectory(path) || directoryExists(path); // May be created concurrently.
+}
+
+
+FileLock::FileLock(const char* path) {
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        return;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        TRACE("Waiting for %s", path);
+        while (flock(fd, LOCK_EX) != 0 && errno == EINTR) {
+        }
+    }
+}
+
+
+FileLock::~FileLock() {
+    if (fd >= 0) {
+        close(fd); // Unlocks.
+    }
+}
+
+
 bool deleteFile(const char* path) {
     return remove(path) == 0;
 }
 
+
+bool removeDirectory(const char* path, uint64_t* bytes, int* files) {
+    Directory dir(path);
+    if (!dir) {
+        return false;
+    }
+    dir.hidden = true;
+    bool ok = true;
+    for (Directory::Entry entry; dir.read(entry, false); ) {
+        char entryPath[maxPath];
+        catPath(path, entry.name, entryPath);
+        if (entry.type == Directory::typeDirectory) {
+            ok = removeDirectory(entryPath, bytes, files) && ok;
+            continue;
+        }
+        if (bytes) {
+            dir.stat(entry);
+            *bytes += entry.size;
+        }
+        if (unlink(entryPath) == 0) {
+            if (files) {
+                (*files)++;
+            }
+        }
+        else {
+            ok = false;
+        }
+    }
+    dir.close();
+    return rmdir(path) == 0 && ok;
+}
+
 char* catPath(const char* dir, const char* name, char* path) {
     return catPath(dir, strlen(dir), name, strlen(name), path);
 }
@@ -74,12 +152,17 @@ bool isAbsPath(const char* path) {
 
 
 char* rebasePath(const char* baseDir, const char* relPath, char* path) {
+    return rebasePath(baseDir, relPath, strlen(relPath), path);
+}
+
+
+char* rebasePath(const char* baseDir, const char* relPath, int relLength, char* path) {
     char temp[maxPath];
     if (isAbsPath(relPath)) {
-        strcpy(temp, relPath);
+        catPath("", 0, relPath, relLength, temp);
     }
     else {
-        catPath(baseDir, strlen(baseDir), relPath, temp);
+        catPath(baseDir, strlen(baseDir), relPath, relLength, temp);
     }
     return normalizePath(temp, path);
 }
@@ -200,78 +283,180 @@ char* normalizePath(const char* in, char* out) {
 }
 
 
-void Directory::close() {
-    if (dir) {
-        closedir((DIR*)dir);
-        dir = nullptr;
-    }
+bool Directory::open(const char* dirPath) {
+    close();
+    fd = ::open(dirPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return fd >= 0;
 }
 
 
-bool Directory::open(const char* dirPath) {
-    close();
-    dir = opendir(dirPath);
-    if (!dir) {
-        path[0] = 0;
-        pathLength = 0;
-        return false;
+void Directory::close() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
     }
-    strncpy(path, dirPath, maxPath - 1);
-    path[maxPath - 1] = 0;
-    pathLength = strlen(path);
-    return true;
+    delete[] buffer;
+    buffer = nullptr;
+    bufferPos = bufferEnd = 0;
 }
 
 
-static uint64_t makeFileTag(const struct stat* s) {
-    uint64_t tag = s->st_size + (uint64_t(s->st_mtime) << 32);
+static uint64_t makeFileTag(uint64_t size, time_t time) {
+    uint64_t tag = size + (uint64_t(time) << 32);
     return tag >= 256 ? tag : (tag + 256); // Small values are reserved. E.g. 0 may mean file does not exist.
 }
 
 
 uint64_t makeFileTag(const char* path) {
     struct stat s;
-    return stat(path, &s) == 0 ? makeFileTag(&s) : 0; 
+    return ::stat(path, &s) == 0 ? makeFileTag(s.st_size, s.st_mtime) : 0; 
 }
 
 
+uint64_t makeDirectoryTag(const char* path) {
+    struct stat s;
+    if (::stat(path, &s) != 0 || !S_ISDIR(s.st_mode)) {
+        return 0;
+    }
+    return uint64_t(s.st_mtim.tv_sec) * 1000000000 + s.st_mtim.tv_nsec;
+}
+
+
+int64_t getFileTime(const char* path) {
+    struct stat s;
+    if (::stat(path, &s) != 0) {
+        return 0;
+    }
+    return int64_t(s.st_mtim.tv_sec) * 1000000000 + s.st_mtim.tv_nsec;
+}
+
+
+bool touchFile(const char* path) {
+    return utimensat(AT_FDCWD, path, nullptr, 0) == 0;
+}
+
+
+bool setFileTime(const char* path, int64_t time) {
+    struct timespec t[2];
+    t[0].tv_sec = 0;
+    t[0].tv_nsec = UTIME_OMIT;
+    t[1].tv_sec = time / 1000000000;
+    t[1].tv_nsec = time % 1000000000;
+    return utimensat(AT_FDCWD, path, t, 0) == 0;
+}
+
+
+int64_t getCurrentTime() {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return int64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+
+// As returned by getdents64(), which has no glibc wrapper everywhere.
+struct DirectoryRecord {
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+};
+
+
 bool Directory::read(Entry& entry, bool full) {
-    if (!dir) {
+    if (fd < 0) {
        return false;  
     }
     for (;;) {
-        struct dirent* e = readdir((DIR*)dir);
-        if (!e) {
-            return false;
+        if (bufferPos >= bufferEnd) {
+            if (!buffer) {
+                buffer = new char[bufferSize];
+            }
+            long n = syscall(SYS_getdents64, fd, buffer, bufferSize);
+            if (n <= 0) {
+                return false;
+            }
+            bufferPos = 0;
+            bufferEnd = int(n);
         }
-        if (e->d_name[0] == '.') {
+        DirectoryRecord* e = (DirectoryRecord*)(buffer + bufferPos);
+        bufferPos += e->reclen;
+        if (e->name[0] == '.' && (!hidden || e->name[1] == 0 || (e->name[1] == '.' && e->name[2] == 0))) {
             continue;
         }
-        switch (e->d_type) {
+        switch (e->type) {
             case DT_DIR: entry.type = typeDirectory; break;
             case DT_REG: entry.type = typeFile; break;
             case DT_LNK: entry.type = typeLink; break;
-            default: continue; // entry.type = typeLink; break;
+            case DT_UNKNOWN: entry.type = typeOther; break; // Some file systems. Stat tells.
+            default: continue;
         }
-        entry.name = e->d_name;
+        entry.name = e->name;
         entry.size = 0;
         entry.time = 0;
         entry.tag = 0;
-        if (full) {
-            char fullName[maxPath];
-            catPath(path, entry.name, fullName);
-            struct stat s;
-            if (stat(fullName, &s) == 0) {
-                entry.size = s.st_size;
-                entry.time = s.st_mtime;
-                entry.tag = makeFileTag(&s);
+        if (entry.type == typeOther) {
+            if (!stat(entry) || entry.type == typeOther) {
+                continue;
             }
         }
+        else if (full) {
+            stat(entry);
+        }
         return true;
     }
 }
 
 
+// Relative to the open directory, so no path building. Only size and time are asked for.
+bool Directory::stat(Entry& entry) {
+#ifdef STATX_SIZE
+    struct statx s;
+    if (statx(fd, entry.name, 0, STATX_TYPE | STATX_SIZE | STATX_MTIME, &s) != 0) {
+        return false;
+    }
+    if (entry.type == typeOther) {
+        entry.type = S_ISDIR(s.stx_mode) ? typeDirectory : S_ISREG(s.stx_mode) ? typeFile : S_ISLNK(s.stx_mode) ? typeLink : typeOther;
+    }
+    entry.size = s.stx_size;
+    entry.time = s.stx_mtime.tv_sec;
+#else
+    struct stat s;
+    if (fstatat(fd, entry.name, &s, 0) != 0) {
+        return false;
+    }
+    if (entry.type == typeOther) {
+        entry.type = S_ISDIR(s.st_mode) ? typeDirectory : S_ISREG(s.st_mode) ? typeFile : S_ISLNK(s.st_mode) ? typeLink : typeOther;
+    }
+    entry.size = s.st_size;
+    entry.time = s.st_mtime;
+#endif
+    entry.tag = makeFileTag(entry.size, entry.time);
+    return true;
+}
+
+
+char* findProgram(const char* name, char* path) {
+    if (strchr(name, '/')) {
+        strcpy(path, name);
+        return path;
+    }
+    const char* dirs = getenv("PATH");
+    while (dirs && *dirs) {
+        const char* end = strchr(dirs, ':');
+        int length = end ? end - dirs : strlen(dirs);
+        if (length) {
+            catPath(dirs, length, name, path);
+            if (access(path, X_OK) == 0) {
+                return path;
+            }
+        }
+        dirs += length + (end ? 1 : 0);
+    }
+    path[0] = 0;
+    return path;
+}
+
 
 bool changeDirectory(const char* dir) {
     return chdir(dir) == 0;
@@ -12,8 +12,17 @@ const int maxPath = 1024;
 // building a derivative.
 uint64_t makeFileTag(const char* path);
 
+// Modification time of a directory, in nanoseconds. Changes when entries are
+// added, removed or renamed. 0 if there is no such directory.
+uint64_t makeDirectoryTag(const char* path);
+int64_t getCurrentTime(); // Nanoseconds, comparable with the above.
+int64_t getFileTime(const char* path); // Modification time, the same way. 0 if no file.
+bool touchFile(const char* path); // Set modification time to now.
+bool setFileTime(const char* path, int64_t time); // Set modification time, nanoseconds.
 
-// For scanning directories.
+
+// For scanning directories. Reads entries in big chunks. Only stats
+// entries if asked to, either all (full read) or selected ones.
 class Directory {
 public:
     enum Type {
@@ -29,18 +38,36 @@ public:
         time_t time;
         uint64_t tag;
     };
+    bool hidden = false; // Also list names starting with '.'.
     Directory() {}
     Directory(const char* path): Directory() { open(path); }
     ~Directory() { close(); }
-    operator bool() const { return dir != nullptr; }
+    operator bool() const { return fd >= 0; }
     bool open(const char* path);
     void close();
     bool read(Entry&, bool full = true);
+    bool stat(Entry&); // Fill in size, time and tag of an entry just read.
 
 private:
-    void* dir = nullptr;
-    char path[maxPath];
-    int pathLength;
+    static constexpr int bufferSize = 32 * 1024;
+    int fd = -1;
+    char* buffer = nullptr;
+    int bufferPos = 0;
+    int bufferEnd = 0;
+};
+
+// Advisory lock (flock) on a file, created if missing. Held while in scope.
+// Coordinates processes, and threads too, each has its own descriptor.
+// If the file can't be created, nothing is locked.
+class FileLock {
+public:
+    FileLock(const char* path);
+    ~FileLock();
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+private:
+    int fd;
 };
 
 // Some path utilities.
@@ -48,7 +75,10 @@ private:
 bool directoryExists(const char*);
 bool fileExists(const char*);
 bool makeDirectory(const char*);
+bool makeDirectories(const char*); // With all missing parents.
 bool deleteFile(const char*);
+// With all its content. Sizes of deleted files are added to 'bytes'.
+bool removeDirectory(const char*, uint64_t* bytes = nullptr, int* files = nullptr);
 bool setVariable(const char*, const char*);
 char* getVariable(const char*);
 
@@ -58,6 +88,7 @@ char* catPath(const char* dir, int dirLength, const char* name, int nameLength,
 char* addSuffix(const char* source, const char* suffix, char* path);
 bool isAbsPath(const char* path);
 char* rebasePath(const char* baseDir, const char* relPath, char* path);
+char* rebasePath(const char* baseDir, const char* relPath, int relLength, char* path);
 char* stripBasePath(const char* baseDir, const char* srcPath, char* path);
 
 const char* getSuffix(const char* path);
@@ -67,6 +98,8 @@ const char* getDirectory(const char* path, char* dir);
 char* normalizePath(const char* in, char* out);
 char* getParentDirectory(const char* in, char* out);
 
+char* findProgram(const char* name, char* path); // Like shell does, in $PATH. Empty if not found.
+
 bool changeDirectory(const char*);
 char* getCurrentDirectory(char*);
 
@@ -1,13 +1,54 @@
 #include "hash.h"
 #include <cstring>
 
-// Not married to it...
-uint32_t hash(const char* p, int length) {
-    uint32_t h = length;
-    for (int i = 0; i < length; i++) {
-        h = h * 101 + p[i];
+static constexpr uint64_t k0 = 0x9e3779b97f4a7c15ull;
+static constexpr uint64_t k1 = 0xbf58476d1ce4e5b9ull;
+
+
+static inline uint64_t rotate(uint64_t x, int n) {
+    return (x << n) | (x >> (64 - n));
+}
+
+
+// Final avalanche, from MurmurHash3.
+static inline uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+
+uint64_t hash64(const char* p, int length) {
+    uint64_t h = k1 ^ (uint64_t(length) * k0);
+    for (; length >= 8; p += 8, length -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = rotate(h ^ (w * k0), 29) * k1;
+    }
+    if (length > 0) {
+        uint64_t w = 0;
+        memcpy(&w, p, length);
+        h = rotate(h ^ (w * k0), 29) * k1;
     }
-    return h * 0x9e3779b9; // N high bits must be suitable for hashing.
+    return mix(h);
+}
+
+
+uint64_t hash64(const char* p) {
+    return hash64(p, strlen(p));
+}
+
+
+uint64_t combineHash(uint64_t a, uint64_t b) {
+    return mix(rotate(a, 23) * k1 + b + k0);
+}
+
+
+uint32_t hash(const char* p, int length) {
+    return uint32_t(hash64(p, length) >> 32);
 }
 
 
@@ -2,6 +2,12 @@
 
 #include <cstdint>
 
+// 64-bit fingerprints, for tags of tools, options and lists of names.
+// Word at a time, so long paths are cheap.
+uint64_t hash64(const char*, int length);
+uint64_t hash64(const char*);
+uint64_t combineHash(uint64_t, uint64_t); // Order matters.
+
+// For hash tables. High bits are the best ones.
 uint32_t hash(const char*, int length);
 uint32_t hash(const char*);
-
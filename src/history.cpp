@@ -0,0 +1,306 @@
+#include "history.h"
+#include "output.h"
+#include "dirs.h"
+
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Report only, STL is hidden here.
+#include <vector>
+#include <algorithm>
+
+
+struct RecordHeader {
+    static constexpr uint32_t currentMagic = 0x48584321; // "!CXH"
+    uint32_t magic;
+    uint32_t size; // Bytes, including this header and all entries.
+    int64_t time; // Start, nanoseconds since epoch.
+    int64_t duration; // Wall time, nanoseconds.
+    uint32_t count; // Entries.
+    uint32_t reserved;
+};
+
+
+struct EntryHeader {
+    int64_t duration;
+    uint16_t length; // Of the name, which follows, zero-terminated, padded to 8 bytes.
+    uint8_t kind;
+    uint8_t reserved[5];
+};
+
+
+static int entrySize(int length) {
+    return (sizeof(EntryHeader) + length + 1 + 7) & ~7;
+}
+
+
+// Records of a loaded blob, in order. Stops at the first damaged one.
+class RecordIterator {
+public:
+    RecordIterator(const Blob& b): blob(b) { validate(); }
+    operator bool() const { return pos >= 0; }
+    const RecordHeader* operator->() const { return (const RecordHeader*)(blob.data + pos); }
+    int offset() const { return pos; }
+    void next() {
+        pos += (*this)->size;
+        validate();
+    }
+private:
+    const Blob& blob;
+    int pos = 0;
+    void validate() {
+        if (pos + int(sizeof(RecordHeader)) <= blob.size) {
+            const RecordHeader* r = (const RecordHeader*)(blob.data + pos);
+            if (r->magic == RecordHeader::currentMagic && r->size >= sizeof(RecordHeader) && pos + int64_t(r->size) <= blob.size) {
+                return;
+            }
+        }
+        pos = -1;
+    }
+};
+
+
+class EntryIterator {
+public:
+    EntryIterator(const RecordHeader* r):
+        p((const char*)(r + 1)),
+        end((const char*)r + r->size)
+    {
+        validate();
+    }
+    operator bool() const { return p != nullptr; }
+    const EntryHeader* operator->() const { return (const EntryHeader*)p; }
+    const char* name() const { return p + sizeof(EntryHeader); }
+    void next() {
+        p += entrySize((*this)->length);
+        validate();
+    }
+private:
+    const char* p;
+    const char* end;
+    void validate() {
+        if (p + sizeof(EntryHeader) <= end && p + entrySize(((const EntryHeader*)p)->length) <= end) {
+            return;
+        }
+        p = nullptr;
+    }
+};
+
+
+bool BuildHistory::load(const char* path) {
+    recordCount = 0;
+    if (!records.load(path)) {
+        records.clear();
+        index();
+        return false;
+    }
+    int valid = 0;
+    for (RecordIterator r(records); r; r.next()) {
+        recordCount++;
+        valid = r.offset() + r->size;
+    }
+    records.size = valid;
+    index();
+    return true;
+}
+
+
+void BuildHistory::index() {
+    latest.clear();
+    int64_t sums[3] = {0, 0, 0};
+    int counts[3] = {0, 0, 0};
+    for (RecordIterator r(records); r; r.next()) {
+        for (EntryIterator e(r.operator->()); e; e.next()) {
+            latest.put(e->duration, e.name(), e->length);
+            if (e->kind < 3) {
+                sums[e->kind] += e->duration;
+                counts[e->kind]++;
+            }
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        averages[i] = counts[i] ? sums[i] / counts[i] : 0;
+    }
+}
+
+
+void BuildHistory::add(TargetKind kind, const char* target, int64_t duration) {
+    current.add((uint64_t(kind) << 56) | uint64_t(duration), target);
+}
+
+
+int64_t BuildHistory::estimate(TargetKind kind, const char* target) const {
+    const FileStateDict::Entry* e = latest.find(target);
+    return e ? int64_t(e->tag) : averages[kind];
+}
+
+
+bool BuildHistory::save(const char* path, int64_t startTime, int64_t duration) {
+    if (current.isEmpty()) {
+        return true;
+    }
+    Blob record;
+    record.growTo(sizeof(RecordHeader));
+    RecordHeader* header = (RecordHeader*)record.data;
+    memset(header, 0, sizeof(RecordHeader));
+    header->magic = RecordHeader::currentMagic;
+    header->time = startTime;
+    header->duration = duration;
+    for (FileStateList::Iterator i(current); i; i.next()) {
+        int offset = record.size;
+        record.growBy(entrySize(i->length));
+        memset(record.data + offset, 0, entrySize(i->length));
+        EntryHeader* entry = (EntryHeader*)(record.data + offset);
+        entry->duration = int64_t(i->tag & ((uint64_t(1) << 56) - 1));
+        entry->kind = uint8_t(i->tag >> 56);
+        entry->length = i->length;
+        memcpy(record.data + offset + sizeof(EntryHeader), i->string, i->length);
+        ((RecordHeader*)record.data)->count++;
+    }
+    ((RecordHeader*)record.data)->size = record.size;
+    if (recordCount + 1 >= 2 * maxRecords) {
+        // Compact: keep the most recent ones only.
+        RecordIterator r(records);
+        for (int skip = recordCount - (maxRecords - 1); skip > 0 && r; skip--) {
+            r.next();
+        }
+        Blob kept;
+        if (r) {
+            kept.add(records.data + r.offset(), records.size - r.offset());
+        }
+        kept.add(record.data, record.size);
+        if (!kept.save(path)) { // Replaced atomically.
+            return false;
+        }
+        current.clear();
+        return true;
+    }
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write(fd, record.data, record.size) == record.size;
+    close(fd);
+    current.clear();
+    return ok;
+}
+
+
+char* formatDuration(int64_t nanoseconds, char* text) {
+    double seconds = nanoseconds * 1e-9;
+    if (nanoseconds < 1000) {
+        sprintf(text, "%dns", int(nanoseconds));
+    }
+    else if (nanoseconds < 1000000) {
+        sprintf(text, "%.1fus", nanoseconds * 1e-3);
+    }
+    else if (nanoseconds < 1000000000) {
+        sprintf(text, "%.2fms", nanoseconds * 1e-6);
+    }
+    else if (seconds < 60) {
+        sprintf(text, "%.2fs", seconds);
+    }
+    else {
+        int s = int(seconds + 0.5);
+        sprintf(text, "%dm %02ds", s / 60, s % 60);
+    }
+    return text;
+}
+
+
+struct Regression {
+    const char* target;
+    int64_t before; // Median of earlier builds.
+    int64_t after; // Latest.
+};
+
+
+void BuildHistory::report(int builds, int top) const {
+    std::vector<const RecordHeader*> window;
+    for (RecordIterator r(records); r; r.next()) {
+        window.push_back(r.operator->());
+    }
+    if (window.empty()) {
+        INFO("No build history");
+        return;
+    }
+    if (int(window.size()) > builds) {
+        window.erase(window.begin(), window.end() - builds);
+    }
+    char text[64];
+    char duration[32];
+    INFO("%sLast %d builds:%s", em, int(window.size()), noem);
+    for (const RecordHeader* r: window) {
+        time_t t = r->time / 1000000000;
+        struct tm local;
+        localtime_r(&t, &local);
+        strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &local);
+        INFO("  %s  %10s  %5d targets", text, formatDuration(r->duration, duration), int(r->count));
+    }
+    // Trend: the older half against the newer half, per rebuilt target, so
+    // builds of different sizes can be compared.
+    if (window.size() >= 2) {
+        int half = window.size() / 2;
+        double perTarget[2] = {0, 0};
+        for (int side = 0; side < 2; side++) {
+            int64_t total = 0;
+            int count = 0;
+            for (int i = side ? half : 0; i < (side ? int(window.size()) : half); i++) {
+                for (EntryIterator e(window[i]); e; e.next()) {
+                    total += e->duration;
+                    count++;
+                }
+            }
+            perTarget[side] = count ? double(total) / count : 0;
+        }
+        if (perTarget[0] > 0) {
+            INFO("Average time per target: %s -> %s (%+.0f%%)",
+                formatDuration(int64_t(perTarget[0]), text),
+                formatDuration(int64_t(perTarget[1]), duration),
+                (perTarget[1] / perTarget[0] - 1) * 100);
+        }
+    }
+    // Regressions: the latest duration of each target against the median of
+    // its earlier ones within the window.
+    FileStateDict slots;
+    std::vector<std::vector<int64_t>> durations;
+    std::vector<const char*> names;
+    for (const RecordHeader* r: window) {
+        for (EntryIterator e(r); e; e.next()) {
+            FileStateDict::Entry* slot;
+            if (slots.add(durations.size(), e.name(), e->length, slot)) {
+                durations.emplace_back();
+                names.push_back(e.name());
+            }
+            durations[slot->tag].push_back(e->duration);
+        }
+    }
+    std::vector<Regression> regressions;
+    for (size_t i = 0; i < durations.size(); i++) {
+        std::vector<int64_t>& d = durations[i];
+        if (d.size() < 2) {
+            continue;
+        }
+        int64_t after = d.back();
+        d.pop_back();
+        std::sort(d.begin(), d.end());
+        int64_t before = d[d.size() / 2];
+        if (after > before) {
+            regressions.push_back({names[i], before, after});
+        }
+    }
+    std::sort(regressions.begin(), regressions.end(), [](const Regression& a, const Regression& b) {
+        return a.after - a.before > b.after - b.before;
+    });
+    if (regressions.empty()) {
+        INFO("No regressions");
+        return;
+    }
+    INFO("%sRegressed most (median before -> latest):%s", em, noem);
+    for (int i = 0; i < int(regressions.size()) && i < top; i++) {
+        const Regression& r = regressions[i];
+        INFO("  %8s -> %8s  %s", formatDuration(r.before, text), formatDuration(r.after, duration), r.target);
+    }
+}
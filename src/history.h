@@ -0,0 +1,39 @@
+#pragma once
+
+#include "lists.h"
+
+// Build time history. One record per build which did any work: when it
+// started, how long it took, and how long each rebuilt target (object,
+// library, program) took. Records are appended to a single file, old ones
+// are dropped from time to time.
+class BuildHistory {
+public:
+    enum TargetKind {
+        kindObject,
+        kindLibrary,
+        kindProgram,
+    };
+    static constexpr int maxRecords = 100;
+    bool load(const char* path);
+    // Targets of the current build.
+    void add(TargetKind, const char* target, int64_t duration);
+    bool isEmpty() const { return current.isEmpty(); }
+    int64_t getAverage(TargetKind kind) const { return averages[kind]; }
+    // Append the current build, if it did anything, and start a new one.
+    bool save(const char* path, int64_t startTime, int64_t duration);
+    // Duration of the target in the most recent build which rebuilt it.
+    // Average of all known targets of that kind if unknown, 0 if no history.
+    int64_t estimate(TargetKind, const char* target) const;
+    // Trend of the last 'builds' builds and targets which regressed most.
+    void report(int builds, int top) const;
+
+private:
+    Blob records; // As stored.
+    int recordCount = 0;
+    FileStateDict latest; // Most recent duration of each target.
+    int64_t averages[3] = {0, 0, 0};
+    FileStateList current; // Tags are durations, kind in the top byte.
+    void index();
+};
+
+char* formatDuration(int64_t nanoseconds, char* text); // Like "850ns", "12.5us", "3.21ms", "1.25s" or "3m 05s".
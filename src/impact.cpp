@@ -0,0 +1,182 @@
+#include "impact.h"
+#include "compiler.h"
+#include "dirs.h"
+#include "output.h"
+#include "history.h"
+
+// Report only, STL is hidden here.
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+
+
+void ImpactReport::addObject(const char* unitPath, const Dependencies& deps, int64_t compileTime, bool hasMain, int64_t programTime) {
+    objectCount++;
+    if (hasMain) {
+        linkTime += programTime;
+    }
+    int unitLength = strlen(unitPath);
+    for (Dependencies::Iterator i(deps); i; i.next()) {
+        FileType type = getFileType(i->string);
+        if (type == typeCSource || type == typeCppSource) {
+            continue;
+        }
+        char absPath[maxPath];
+        char normalized[maxPath];
+        normalizePath(rebasePath(unitPath, i->string, i->length, absPath), normalized);
+        int length = strlen(normalized);
+        FileStateDict::Entry* e;
+        headerCost.add(0, normalized, length, e);
+        e->tag += compileTime;
+        headerCount.add(0, normalized, length, e);
+        e->tag++;
+        char key[maxPath * 2];
+        if (hasMain) {
+            headerLinkTime.add(0, normalized, length, e);
+            e->tag += programTime;
+        }
+        else {
+            memcpy(key, normalized, length + 1);
+            memcpy(key + length + 1, unitPath, unitLength);
+            StringDict::Entry* u;
+            headerUnits.add(key, length + 1 + unitLength, u);
+        }
+        memcpy(key, unitPath, unitLength + 1);
+        memcpy(key + unitLength + 1, normalized, length);
+        unitInclusions.add(0, key, unitLength + 1 + length, e);
+        e->tag++;
+    }
+}
+
+
+void ImpactReport::addLibrary(const char* unitPath, int64_t archiveTime) {
+    libraryTime.put(archiveTime, unitPath);
+}
+
+
+// Header costs with archiving and linking added. Any dependent library
+// object means relinking of all programs, otherwise only of dependent ones.
+void ImpactReport::getTotals(FileStateDict& totals) const {
+    for (FileStateDict::Iterator i(headerCost); i; i.next()) {
+        const FileStateDict::Entry* link = headerLinkTime.find(i->string, i->length);
+        totals.put(i->tag + (link ? link->tag : 0), i->string, i->length);
+    }
+    StringDict relinkAll;
+    for (StringDict::Iterator i(headerUnits); i; i.next()) {
+        int length = strlen(i->string);
+        const char* unit = i->string + length + 1;
+        const FileStateDict::Entry* archive = libraryTime.find(unit, i->length - length - 1);
+        FileStateDict::Entry* total;
+        totals.add(0, i->string, length, total);
+        total->tag += archive ? archive->tag : 0;
+        StringDict::Entry* e;
+        if (relinkAll.add(i->string, length, e)) {
+            const FileStateDict::Entry* link = headerLinkTime.find(i->string, length);
+            total->tag += linkTime - (link ? link->tag : 0);
+        }
+    }
+}
+
+
+int64_t ImpactReport::getHeaderCost(const char* path) const {
+    FileStateDict totals;
+    getTotals(totals);
+    const FileStateDict::Entry* e = totals.find(path);
+    return e ? int64_t(e->tag) : 0;
+}
+
+
+int ImpactReport::getHeaderCount(const char* path) const {
+    const FileStateDict::Entry* e = headerCount.find(path);
+    return e ? int(e->tag) : 0;
+}
+
+
+int ImpactReport::getCoupling(const char* fromUnit, const char* toUnit) const {
+    int count = 0;
+    int fromLength = strlen(fromUnit);
+    int toLength = strlen(toUnit);
+    for (FileStateDict::Iterator i(unitInclusions); i; i.next()) {
+        const char* header = i->string + fromLength + 1;
+        if (strcmp(i->string, fromUnit) == 0 &&
+            getDirectoryPartLength(header) == toLength && strncmp(header, toUnit, toLength) == 0)
+        {
+            count += int(i->tag);
+        }
+    }
+    return count;
+}
+
+
+struct Coupling {
+    int inclusions = 0;
+    int headers = 0;
+    const char* topHeader = nullptr;
+    int topInclusions = 0;
+};
+
+
+void ImpactReport::print(int top) const {
+    if (objectCount == 0) {
+        INFO("No objects, nothing to analyze");
+        return;
+    }
+    FileStateDict totals;
+    getTotals(totals);
+    std::vector<const FileStateDict::Entry*> headers;
+    for (FileStateDict::Iterator i(totals); i; i.next()) {
+        headers.push_back(i.operator->());
+    }
+    std::sort(headers.begin(), headers.end(), [&](const FileStateDict::Entry* a, const FileStateDict::Entry* b) {
+        if (a->tag != b->tag) {
+            return a->tag > b->tag;
+        }
+        return headerCount.find(a->string, a->length)->tag > headerCount.find(b->string, b->length)->tag;
+    });
+    char text[32];
+    INFO("%sRebuild impact of headers (%d headers, %d objects):%s", em, int(headers.size()), objectCount, noem);
+    INFO("  %10s  %7s  %s", "cost", "objects", "header");
+    for (int i = 0; i < int(headers.size()) && i < top; i++) {
+        const FileStateDict::Entry* e = headers[i];
+        INFO("  %10s  %7d  %s", formatDuration(e->tag, text), int(headerCount.find(e->string, e->length)->tag), e->string);
+    }
+    // Coupling: pairs of different units, by inclusions.
+    std::map<std::pair<std::string, std::string>, Coupling> pairs;
+    for (FileStateDict::Iterator i(unitInclusions); i; i.next()) {
+        const char* from = i->string;
+        int fromLength = strlen(from);
+        const char* header = from + fromLength + 1;
+        int toLength = getDirectoryPartLength(header);
+        if (toLength == fromLength && strncmp(from, header, toLength) == 0) {
+            continue;
+        }
+        Coupling& c = pairs[std::make_pair(std::string(from, fromLength), std::string(header, toLength))];
+        c.inclusions += int(i->tag);
+        c.headers++;
+        if (int(i->tag) > c.topInclusions) {
+            c.topInclusions = int(i->tag);
+            c.topHeader = header;
+        }
+    }
+    if (pairs.empty()) {
+        INFO("No headers included across units");
+        return;
+    }
+    typedef std::map<std::pair<std::string, std::string>, Coupling>::const_iterator Pair;
+    std::vector<Pair> sorted;
+    for (Pair i = pairs.begin(); i != pairs.end(); ++i) {
+        sorted.push_back(i);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](Pair a, Pair b) {
+        return a->second.inclusions > b->second.inclusions;
+    });
+    INFO("%sUnit coupling (inclusions of headers of another unit):%s", em, noem);
+    INFO("  %10s  %7s  %s", "inclusions", "headers", "units");
+    for (int i = 0; i < int(sorted.size()) && i < top; i++) {
+        const std::string& to = sorted[i]->first.second;
+        const Coupling& c = sorted[i]->second;
+        INFO("  %10d  %7d  %s -> %s (mostly %s)",
+            c.inclusions, c.headers, sorted[i]->first.first.c_str(), to.c_str(), c.topHeader + to.size());
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "lists.h"
+
+// What touching a header costs (see --impact): compile time of all objects
+// depending on it, plus archiving of libraries containing them, plus linking
+// of programs using those libraries or objects. Durations come from build
+// history, so the estimate is as good as the history is.
+//
+// Also coupling of units: how many headers of one unit are included by
+// sources of another, and how many times.
+class ImpactReport {
+public:
+    // Object compiled in 'unitPath', with its dependencies (relative to the
+    // unit) and its compile time. Program link time if the object has main().
+    void addObject(const char* unitPath, const Dependencies&, int64_t compileTime, bool hasMain, int64_t linkTime);
+    // Unit library archiving time. Programs (all of them) are relinked when it changes.
+    void addLibrary(const char* unitPath, int64_t archiveTime);
+    void print(int top) const;
+
+    // Exposed for testing. Times are in nanoseconds.
+    int64_t getHeaderCost(const char* path) const;
+    int getHeaderCount(const char* path) const;
+    int getCoupling(const char* fromUnit, const char* toUnit) const; // Inclusions.
+
+private:
+    int objectCount = 0;
+    int64_t linkTime = 0; // All programs.
+    FileStateDict headerCost; // Compile time of dependent objects.
+    FileStateDict headerCount; // Dependent objects.
+    FileStateDict headerLinkTime; // Programs of dependent objects with main().
+    StringDict headerUnits; // "header\0unit", units with dependent library objects.
+    FileStateDict libraryTime; // Per unit.
+    FileStateDict unitInclusions; // "from\0header", sources of unit 'from' including it.
+    void getTotals(FileStateDict&) const;
+};
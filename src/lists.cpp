@@ -5,6 +5,14 @@
 #include <cstdio> 
 
 
+int emptyHashTable[1 << initialHashTableSizePower] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+
 // Putting trivial wrappers here, don't want them to be inlined.
 
 void StringList::add(const char* data, int length) {
@@ -73,6 +81,7 @@ bool Dependencies::load(const char* path) {
 bool Dependencies::save(const char* path) {
     DepsHeader& header = getHeader();
     header.magic = DepsHeader::magicValue;
+    header.version = DepsHeader::currentVersion;
     header.zero64 = 0;
     return FileStateList::save(path);
 }
@@ -85,24 +94,25 @@ bool DepsHeader::load(const char* path) {
 
 bool DepsHeader::save(const char* path) {
     magic = magicValue;
+    version = currentVersion;
     zero64 = 0;
     return ::save(path, this, sizeof(*this));
 }
 
 
-uint32_t getStringListHash(const StringList& list) {
-    uint32_t h = 0;
+uint64_t getStringListHash(const StringList& list) {
+    uint64_t h = 0;
     for (StringList::Iterator i(list); i; i.next()) {
-        h = h * 3 + hash(i->string, i->length);
+        h = combineHash(h, hash64(i->string, i->length));
     }
     return h;
 }
 
 
-uint32_t getStringListHash(const StringDict& list) {
-    uint32_t h = 0;
+uint64_t getStringListHash(const StringDict& list) {
+    uint64_t h = 0;
     for (StringDict::Iterator i(list); i; i.next()) {
-        h = h * 3 + hash(i->string, i->length);
+        h = combineHash(h, hash64(i->string, i->length));
     }
     return h;
 }
@@ -75,22 +75,31 @@ protected:
 
 // The same with index (hash table).
 
+// Shared by all empty containers, so those which stay empty cost nothing.
+// Never written to.
+static constexpr int initialHashTableSizePower = 6;
+extern int emptyHashTable[1 << initialHashTableSizePower];
+
 template <class EntryType>
 class IndexedStringContainerBase: public StringContainerBase<EntryType> {
 public:
     using Entry = typename StringContainerBase<EntryType>::Entry;
     using Iterator = typename StringContainerBase<EntryType>::Iterator;
     IndexedStringContainerBase(int headerSize = 0): StringContainerBase<EntryType>(headerSize) {
-        hashTableSizePower = 6;
+        hashTableSizePower = initialHashTableSizePower;
         hashTableSize = 1 << hashTableSizePower;
-        hashTable = allocHashTable(hashTableSize);    
+        hashTable = emptyHashTable;
     }
     ~IndexedStringContainerBase() {
-        delete[] hashTable;
+        if (hashTable != emptyHashTable) {
+            delete[] hashTable;
+        }
     }
     void clear() {
         StringContainerBase<EntryType>::clear();
-        initHashTable(hashTable, hashTableSize);
+        if (hashTable != emptyHashTable) {
+            initHashTable(hashTable, hashTableSize);
+        }
     }
     Entry* find(const char* name, int length) const {
         uint32_t h = hash(name, length);
@@ -131,6 +140,9 @@ protected:
         }
     }
     bool insert(const char* name, int length, Entry*& entry) {
+        if (hashTable == emptyHashTable) {
+            hashTable = allocHashTable(hashTableSize);
+        }
         uint32_t h = hash(name, length);
         int slot = h >> (32 - hashTableSizePower);
         int head = hashTable[slot];
@@ -250,23 +262,24 @@ public:
 // A simple dependency file without an explicit list of dependencies (just their combined "tag").
 // (they are implicitly defined by something else, like a list of source files in unit directory)
 
-struct DepsHeader {  // 32 bytes.
+struct DepsHeader {  // 40 bytes.
     static constexpr uint32_t magicValue = 0x000055FF;
+    static constexpr uint16_t currentVersion = 2; // Bump on any change of layout or of tag calculation.
     uint32_t magic;
-    uint32_t toolTag; // Like compiler type/version.
-    uint32_t optTag; // Command arguments.
+    uint16_t version;
     uint8_t flags;
-    uint8_t reserved1;
-    uint8_t reserved2;
-    uint8_t reserved3;
+    uint8_t reserved;
+    uint64_t toolTag; // Like compiler type/version.
+    uint64_t optTag; // Command arguments.
     uint64_t inputsTag; // All inputs combined.
     uint64_t zero64;
     void clear() {
         memset(this, 0, sizeof(*this));
         magic = magicValue;
+        version = currentVersion;
     }
     DepsHeader() { clear(); }
-    bool isValid() const { return magic == magicValue; }
+    bool isValid() const { return magic == magicValue && version == currentVersion; }
     bool load(const char* path);
     bool save(const char* path);
 };
@@ -281,6 +294,6 @@ public:
 };
 
 
-uint32_t getStringListHash(const StringList&);
-uint32_t getStringListHash(const StringDict&);
+uint64_t getStringListHash(const StringList&);
+uint64_t getStringListHash(const StringDict&);
 
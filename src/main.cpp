@@ -1,5 +1,7 @@
 #include <cstdio> 
 #include <cstring> 
+#include <cstdlib> 
+#include <csignal>
 
 #include "builder.h"
 #include "lists.h"
@@ -12,7 +14,19 @@ const char* config = "";
 Builder::Options buildOptions;
 StringList runArgs;
 bool sanity = false;
+bool microbenchmarking = false;
+bool testing = false;
+bool watching = false;
+bool training = false;
+bool benchmarking = false;
+bool evaluating = false;
+int sampleFrequency = 0;
+bool counting = false;
+bool countingInstructions = false;
+BenchOptions benchOptions;
+int historyBuilds = 0;
 bool clean = false;
+bool gc = false;
 bool all = false;
 bool cleanOnly = true;
 bool help = false;
@@ -45,12 +59,83 @@ void printHelp() {
     printf("    Build for configuration <config_id>. The same effect may be acheived by\n");
     printf("    setting environment variable CX_CONFIG (command line option overrides that).\n");
     printf("    By default configuration 'default' is assumed.\n");
+    printf("--watch\n");
+    printf("    Build and run NAME, then keep watching its sources. When any of them\n");
+    printf("    changes, rebuild what's needed, and restart the program.\n");
+    printf("--test\n");
+    printf("    Build everything in directory NAME (or current directory) recursively,\n");
+    printf("    then run all programs (sources defining main()) in parallel as tests.\n");
+    printf("    ARGs are passed to every test. A test passes if it exits with status 0.\n");
+    printf("    Tests which have not changed since they last passed are skipped.\n");
+    printf("--filter=<wildcard>\n");
+    printf("    With --test, run only tests with matching source names, e.g. '*_test.cpp'.\n");
+    printf("--timeout=<seconds>\n");
+    printf("    With --test, kill tests running longer than that. No limit by default.\n");
+    printf("--pgo-train\n");
+    printf("    Profile guided optimization. Build NAME instrumented, run it with ARGs\n");
+    printf("    as training, then rebuild it optimized with the collected profile data.\n");
+    printf("--pgo\n");
+    printf("    Build and run the optimized variant, made with --pgo-train.\n");
+    printf("--bench[=<runs>]\n");
+    printf("    Build NAME and run it with ARGs that many times (10 by default), after\n");
+    printf("    warmup runs. Print min, median, mean and stddev of wall and CPU time,\n");
+    printf("    and compare with the previous results (Mann-Whitney U test).\n");
+    printf("--warmup=<runs>\n");
+    printf("    With --bench, runs not measured. 1 by default.\n");
+    printf("--cpu=<n>\n");
+    printf("    With --bench or --counters, pin the program to CPU n.\n");
+    printf("--no-aslr\n");
+    printf("    With --bench, disable address space layout randomization.\n");
+    printf("--save-baseline=<name>\n");
+    printf("    With --bench or --counters=instructions, also save the results as\n");
+    printf("    baseline <name>.\n");
+    printf("--baseline=<name>\n");
+    printf("    With --bench or --counters=instructions, compare with baseline <name>\n");
+    printf("    instead of the previous run.\n");
+    printf("--profile[=<hz>]\n");
+    printf("    Build NAME with frame pointers, run it with ARGs, sampling its call stacks\n");
+    printf("    (1000 times per second of CPU time by default). Print functions taking\n");
+    printf("    the most time, and save folded stacks for flame graphs.\n");
+    printf("--counters[=instructions]\n");
+    printf("    Build NAME, run it with ARGs and print its event counters, with threads\n");
+    printf("    and children, in user space: instructions, cycles, IPC, L1D and LLC misses,\n");
+    printf("    branch misses and page faults. With '=instructions', count instructions\n");
+    printf("    only, without ASLR, and compare with the previous run (or --baseline).\n");
+    printf("--max-increase=<percent>\n");
+    printf("    With --counters=instructions, fail if the count grew by more than that.\n");
+    printf("--eval [STATEMENTS|-] [ARG]...\n");
+    printf("    Run C++ statements as the body of main(argc, argv), after a precompiled\n");
+    printf("    prelude of includes (eval_prelude in cx.top/cx.unit, or common standard\n");
+    printf("    headers). Linked with libraries of the current directory's unit, which\n");
+    printf("    is built first. Without STATEMENTS, or with '-', they are read from stdin.\n");
+    printf("--time-report\n");
+    printf("    Build NAME (or the current directory), don't run. Compile with compiler's\n");
+    printf("    time reports, and print the most expensive headers (parse time multiplied\n");
+    printf("    by the number of sources including them) and template instantiations.\n");
+    printf("--impact\n");
+    printf("    Build NAME (or the current directory), don't run. Rank headers by what\n");
+    printf("    touching them costs: compile time of objects depending on them, plus\n");
+    printf("    archiving and linking, as recorded in build history. Also show which\n");
+    printf("    units include headers of which other units, and how much.\n");
+    printf("--keep-going\n");
+    printf("    On errors, keep building whatever does not depend on what failed.\n");
+    printf("    By default the build stops at the first error: queued jobs are dropped\n");
+    printf("    and running compilers are killed.\n");
     printf("--clean\n");
     printf("    Clean build state (delete artifacts directories) recursively, starting\n");
     printf("    with the specied directory (or current directory, if omitted). Only for\n");
     printf("    the specified or implied configuration.\n");
     printf("--clean-all\n");
     printf("    Like above, but for all configurations.\n");
+    printf("--gc\n");
+    printf("    Delete build artifacts of sources which no longer exist, recursively,\n");
+    printf("    starting with the specified directory (or current directory). With\n");
+    printf("    cache_limit set in cx.top, also delete least recently used configurations\n");
+    printf("    until the rest fits. With cache_limit, this is also done automatically\n");
+    printf("    for the whole tree once a day.\n");
+    printf("--history[=<builds>]\n");
+    printf("    Show how long the last builds (20 by default) of NAME (or the current\n");
+    printf("    directory) took, the trend, and the targets which got slower most.\n");
     printf("--color=auto|never|always\n");
     printf("    Enable color. By default auto, meaning enabled if stderr is a terminal.\n");
     printf("-q, --quiet\n");
@@ -70,7 +155,7 @@ void parseOptions(const char* args[]) {
              buildOptions.runArgs->add(arg);
              continue;
          }
-         if (arg[0] == '-') {
+         if (arg[0] == '-' && arg[1]) { // Alone, it's stdin.
              const char* opt = arg + 1;
              if (*opt == '-') {
                  opt++;
@@ -78,11 +163,28 @@ void parseOptions(const char* args[]) {
              int length = strlen(opt);
              bool ok = false;
              switch (*opt) {
+                 case 'g':
+                     if (strcmp(opt, "gc") == 0) {
+                         gc = true;
+                         ok = true;
+                     }
+                     break;
                  case 'h':
                      if (opt[1] == 0 || strcmp(opt, "help") == 0) {
                          help = true;
                          ok = true;
                      }
+                     else if (strcmp(opt, "history") == 0) {
+                         historyBuilds = 20;
+                         ok = true;
+                     }
+                     else if (strncmp(opt, "history=", 8) == 0) {
+                         historyBuilds = atoi(opt + 8);
+                         if (historyBuilds <= 0) {
+                             PANIC("Expected: --history=<builds>");
+                         }
+                         ok = true;
+                     }
                      break;
                  case 'q':
                      if (opt[1] == 0 || strcmp(opt, "quiet") == 0) {
@@ -102,6 +204,24 @@ void parseOptions(const char* args[]) {
                          cleanOnly = false;
                          ok = true;
                      }
+                     else if (strcmp(opt, "bench") == 0) {
+                         benchmarking = true;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     else if (strncmp(opt, "bench=", 6) == 0) {
+                         benchOptions.runs = atoi(opt + 6);
+                         if (benchOptions.runs <= 0) {
+                             PANIC("Expected: --bench=<runs>");
+                         }
+                         benchmarking = true;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     else if (strncmp(opt, "baseline=", 9) == 0 && opt[9]) {
+                         benchOptions.baseline = opt + 9;
+                         ok = true;
+                     }
                      break;
                  case 'c':
                      if (strcmp(opt, "clean") == 0) {
@@ -113,6 +233,24 @@ void parseOptions(const char* args[]) {
                          all = true;
                          ok = true;
                      }
+                     else if (strcmp(opt, "counters") == 0) {
+                         counting = true;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     else if (strcmp(opt, "counters=instructions") == 0) {
+                         counting = true;
+                         countingInstructions = true;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     else if (strncmp(opt, "cpu=", 4) == 0) {
+                         benchOptions.cpu = atoi(opt + 4);
+                         if (benchOptions.cpu < 0 || !opt[4]) {
+                             PANIC("Expected: --cpu=<n>");
+                         }
+                         ok = true;
+                     }
                      else if (strncmp(opt, "config=", 7) == 0) {
                          config = opt + 7;
                          ok = true;
@@ -139,18 +277,126 @@ void parseOptions(const char* args[]) {
                          cleanOnly = false;
                          ok = true;
                      }
+                     else if (strncmp(opt, "filter=", 7) == 0) {
+                         buildOptions.testFilter = opt + 7;
+                         ok = true;
+                     }
+                     break;
+                 case 't':
+                     if (strcmp(opt, "test") == 0) {
+                         testing = true;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     else if (strcmp(opt, "time-report") == 0) {
+                         buildOptions.timeReport = true;
+                         buildOptions.skipRunning = true;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     else if (strncmp(opt, "timeout=", 8) == 0) {
+                         buildOptions.testTimeout = atoi(opt + 8);
+                         if (buildOptions.testTimeout <= 0) {
+                             PANIC("Expected: --timeout=<seconds>");
+                         }
+                         ok = true;
+                     }
+                     break;
+                 case 'p':
+                     if (strcmp(opt, "pgo") == 0) {
+                         buildOptions.pgo = Profile::pgoUse;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     else if (strcmp(opt, "pgo-train") == 0) {
+                         training = true;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     else if (strcmp(opt, "profile") == 0) {
+                         sampleFrequency = 1000;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     else if (strncmp(opt, "profile=", 8) == 0) {
+                         sampleFrequency = atoi(opt + 8);
+                         if (sampleFrequency <= 0) {
+                             PANIC("Expected: --profile=<hz>");
+                         }
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     break;
+                 case 'i':
+                     if (strcmp(opt, "impact") == 0) {
+                         buildOptions.impact = true;
+                         buildOptions.skipRunning = true;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     break;
+                 case 'w':
+                     if (strcmp(opt, "watch") == 0) {
+                         watching = true;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     else if (strncmp(opt, "warmup=", 7) == 0) {
+                         benchOptions.warmup = atoi(opt + 7);
+                         if (benchOptions.warmup < 0 || !opt[7]) {
+                             PANIC("Expected: --warmup=<runs>");
+                         }
+                         ok = true;
+                     }
+                     break;
+                 case 'e':
+                     if (strcmp(opt, "eval") == 0) {
+                         evaluating = true;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     break;
+                 case 'n':
+                     if (strcmp(opt, "no-aslr") == 0) {
+                         benchOptions.noAslr = true;
+                         ok = true;
+                     }
                      break;
-                 // Secret. For debugging only.
                  case 's':
-                     if (strcmp(opt, "sanity") == 0) { // Run unit tests.
+                     if (strncmp(opt, "save-baseline=", 14) == 0 && opt[14]) {
+                         benchOptions.saveBaseline = opt + 14;
+                         ok = true;
+                     }
+                     // Secret. For debugging only.
+                     else if (strcmp(opt, "sanity") == 0) { // Run unit tests.
                          sanity = true;
                          cleanOnly = false;
                          ok = true;
                      }
                      break;
-                 // Secret. For debugging only.
+                 case 'm':
+                     if (strncmp(opt, "max-increase=", 13) == 0) {
+                         char* end;
+                         benchOptions.maxIncrease = strtod(opt + 13, &end);
+                         if (end == opt + 13 || *end || benchOptions.maxIncrease < 0) {
+                             PANIC("Expected: --max-increase=<percent>");
+                         }
+                         ok = true;
+                     }
+                     // Secret. For debugging only.
+                     else if (strcmp(opt, "microbench") == 0) { // Run internal microbenchmarks.
+                         microbenchmarking = true;
+                         cleanOnly = false;
+                         ok = true;
+                     }
+                     break;
                  case 'k':
-                     if (strcmp(opt, "keep-deps") == 0) { // Keep make dependency files produced by GCC.
+                     if (strcmp(opt, "keep-going") == 0) {
+                         buildOptions.keepGoing = true;
+                         ok = true;
+                     }
+                     // Secret. For debugging only.
+                     else if (strcmp(opt, "keep-deps") == 0) { // Keep make dependency files produced by GCC.
                          buildOptions.keepDeps = true;
                          ok = true;
                      }
@@ -184,26 +430,89 @@ bool doit(const char* argv[]) {
         return true;
     }
     if (clean) {
-        if (!Builder::clean(path, all ? nullptr : config)) {
+        Builder builder;
+        if (!builder.clean(path, all ? nullptr : config)) {
+            return false;
+        }
+        if (cleanOnly) {
+            return true;
+        }
+    }
+    if (gc) {
+        Builder builder;
+        if (!builder.collectGarbage(path, config)) {
             return false;
         }
         if (cleanOnly) {
             return true;
         }
     }
+    if (historyBuilds) {
+        Builder builder;
+        return builder.showHistory(path, config, historyBuilds);
+    }
     if (sanity) {
         extern void test();
         test();
         return true;
     }
+    if (microbenchmarking) {
+        extern void microbench();
+        microbench();
+        return true;
+    }
 
     Builder builder;
     builder.options = buildOptions;
 
+    if (testing) {
+        return builder.test(path, config);
+    }
+    if (watching) {
+        return builder.watch(path, config);
+    }
+    if (training) {
+        return builder.train(path, config);
+    }
+    if (benchmarking) {
+        return builder.bench(path, config, benchOptions);
+    }
+    if (counting) {
+        return builder.count(path, config, countingInstructions, benchOptions);
+    }
+    if (sampleFrequency) {
+        return builder.sample(path, config, sampleFrequency);
+    }
+    if (evaluating) {
+        // NAME is the snippet. If omitted, or "-", it comes from stdin.
+        Blob snippet;
+        if (*path && strcmp(path, "-") != 0) {
+            snippet.add(path);
+        }
+        else {
+            char buffer[4096];
+            while (int n = fread(buffer, 1, sizeof(buffer), stdin)) {
+                snippet.add(buffer, n);
+            }
+        }
+        snippet.add("", 1);
+        return builder.eval(snippet.data, config);
+    }
     return builder.build(path, config);
 }
 
+// Compilers and tests run in their own process groups, so they don't get
+// terminal's signals. Pass them on.
+static void onSignal(int signal) {
+    Runner::signalAll(signal);
+    ::signal(signal, SIG_DFL);
+    raise(signal);
+}
+
 int main(int argc, const char* argv[]) {
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    signal(SIGHUP, onSignal);
     bool ok = doit(argv);
     delayedErrorFlush();
     return ok ? 0 : 1;
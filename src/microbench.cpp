@@ -0,0 +1,386 @@
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "output.h"
+#include "async.h"
+#include "lists.h"
+#include "dirs.h"
+#include "compiler.h"
+#include "hash.h"
+#include "builder.h"
+
+
+// Rough numbers, for comparing implementations on the same machine.
+
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+static void report(const char* what, int count, double seconds) {
+    say(logLevelInfo, "%-40s %10.1f ns/op %12.0f op/s", what, seconds * 1e9 / count, count / seconds);
+}
+
+
+struct EmptyJob: public Job {
+    void run() override {}
+};
+
+
+// Fans out into its own batch from inside a worker, like unit library jobs do.
+struct FanOutJob: public Job {
+    int count;
+    FanOutJob(int n): count(n) {}
+    void run() override {
+        Batch batch;
+        for (int i = 0; i < count; i++) {
+            Job* job = new EmptyJob();
+            job->priority = (i & 1) ? priorityHigh : priorityNormal;
+            batch.send(job);
+        }
+        batch.discard();
+    }
+};
+
+
+void benchBatchThroughput() {
+    const int count = 200000;
+    {
+        Batch batch;
+        double start = now();
+        for (int i = 0; i < count; i++) {
+            batch.send(new EmptyJob());
+        }
+        batch.discard();
+        report("Batch: send all, then receive", count, now() - start);
+    }
+    {
+        Batch batch;
+        const int window = 64;
+        double start = now();
+        for (int i = 0; i < window; i++) {
+            batch.send(new EmptyJob());
+        }
+        for (int i = window; i < count; i++) {
+            delete batch.receive();
+            batch.send(new EmptyJob());
+        }
+        batch.discard();
+        report("Batch: sliding window of 64", count, now() - start);
+    }
+    {
+        const int outer = 1000;
+        const int inner = count / outer;
+        Batch batch;
+        double start = now();
+        for (int i = 0; i < outer; i++) {
+            batch.send(new FanOutJob(inner));
+        }
+        batch.discard();
+        report("Batch: nested fan-out from workers", outer * (inner + 1), now() - start);
+    }
+}
+
+
+// Paths like the ones found in dependency files: system headers, headers of
+// other units (relative, with some ".." and "."), own sources.
+class PathGenerator {
+public:
+    char* next(char* path) {
+        static const char* systemDirs[] = {
+            "/usr/include/",
+            "/usr/include/c++/11/",
+            "/usr/include/c++/11/bits/",
+            "/usr/include/x86_64-linux-gnu/bits/",
+            "/usr/lib/gcc/x86_64-linux-gnu/11/include/",
+        };
+        static const char* names[] = {
+            "vector", "stl_vector.h", "stdio.h", "types.h", "allocator.h",
+            "config.h", "string_view", "memory", "stddef.h", "char_traits.h",
+        };
+        uint32_t r = random();
+        switch (r % 4) {
+            case 0:
+                sprintf(path, "%s%s", systemDirs[(r >> 2) % 5], names[(r >> 5) % 10]);
+                break;
+            case 1:
+                sprintf(path, "%s%s_%u.h", systemDirs[(r >> 2) % 5], names[(r >> 5) % 10], (r >> 9) % 64);
+                break;
+            case 2:
+                sprintf(path, "../../common/units/u%u/./h%u.h", (r >> 2) % 200, (r >> 10) % 20);
+                break;
+            default:
+                sprintf(path, "src/m%u/../m%u/s%u.cpp", (r >> 2) % 30, (r >> 7) % 30, (r >> 12) % 50);
+                break;
+        }
+        return path;
+    }
+private:
+    uint32_t state = 12345;
+    uint32_t random() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+};
+
+
+static void makePaths(int count, StringList& paths) {
+    PathGenerator generator;
+    char path[maxPath];
+    for (int i = 0; i < count; i++) {
+        paths.add(generator.next(path));
+    }
+}
+
+
+void benchFileStateDict() {
+    const int count = 20000;
+    const int repeat = 20;
+    StringList paths;
+    makePaths(count, paths);
+    double insertTime = 0;
+    double findTime = 0;
+    double missTime = 0;
+    int found = 0;
+    for (int r = 0; r < repeat; r++) {
+        FileStateDict dict;
+        double start = now();
+        uint64_t tag = 0;
+        for (StringList::Iterator i(paths); i; i.next()) {
+            dict.put(++tag, i->string, i->length);
+        }
+        insertTime += now() - start;
+        start = now();
+        for (StringList::Iterator i(paths); i; i.next()) {
+            found += dict.find(i->string, i->length) != nullptr;
+        }
+        findTime += now() - start;
+        start = now();
+        for (StringList::Iterator i(paths); i; i.next()) {
+            found += dict.find(i->string, i->length - 1) != nullptr;
+        }
+        missTime += now() - start;
+    }
+    report("FileStateDict: put", count * repeat, insertTime);
+    report("FileStateDict: find, hit", count * repeat, findTime);
+    report("FileStateDict: find, miss", count * repeat, missTime);
+    if (found < count * repeat) {
+        say(logLevelError, "Unexpected find results");
+    }
+}
+
+
+void benchContainers() {
+    const int count = 20000;
+    const int repeat = 50;
+    StringList paths;
+    makePaths(count, paths);
+    FileStateList list;
+    double start = now();
+    for (int r = 0; r < repeat; r++) {
+        list.clear();
+        for (StringList::Iterator i(paths); i; i.next()) {
+            list.add(r, i->string, i->length);
+        }
+    }
+    report("FileStateList: add", count * repeat, now() - start);
+    uint64_t sum = 0;
+    start = now();
+    for (int r = 0; r < repeat; r++) {
+        for (FileStateList::Iterator i(list); i; i.next()) {
+            sum += i->tag + i->length;
+        }
+    }
+    report("FileStateList: iterate", count * repeat, now() - start);
+    start = now();
+    for (int r = 0; r < repeat; r++) {
+        for (StringList::Iterator i(paths); i; i.next()) {
+            sum += i->length;
+        }
+    }
+    report("StringList: iterate", count * repeat, now() - start);
+    if (sum == 0) {
+        say(logLevelError, "Unexpected iteration results");
+    }
+}
+
+
+void benchDependencies() {
+    // Typical C++ source: a couple hundred headers.
+    const int count = 200;
+    const int repeat = 5000;
+    StringList paths;
+    makePaths(count, paths);
+    Dependencies deps;
+    uint64_t tag = 0;
+    for (StringList::Iterator i(paths); i; i.next()) {
+        deps.add(++tag, i->string, i->length);
+    }
+    char path[maxPath];
+    snprintf(path, sizeof(path), "/tmp/cx.microbench.%d.deps", int(getpid()));
+    if (!deps.save(path)) {
+        say(logLevelError, "Cannot write %s", path);
+        return;
+    }
+    // Load and walk, like dependency checking does.
+    double start = now();
+    for (int r = 0; r < repeat; r++) {
+        Dependencies loaded;
+        if (!loaded.load(path)) {
+            say(logLevelError, "Cannot load %s", path);
+            break;
+        }
+        int n = 0;
+        for (Dependencies::Iterator i(loaded); i; i.next()) {
+            n++;
+        }
+        if (n != count) {
+            say(logLevelError, "Unexpected number of entries in %s", path);
+            break;
+        }
+    }
+    report("Dependencies: load, 200 entries", repeat, now() - start);
+    deleteFile(path);
+}
+
+
+void benchPaths() {
+    const int count = 20000;
+    const int repeat = 20;
+    StringList paths;
+    makePaths(count, paths);
+    char out[maxPath];
+    int total = 0;
+    double start = now();
+    for (int r = 0; r < repeat; r++) {
+        for (StringList::Iterator i(paths); i; i.next()) {
+            total += normalizePath(i->string, out)[0];
+        }
+    }
+    report("normalizePath", count * repeat, now() - start);
+    start = now();
+    for (int r = 0; r < repeat; r++) {
+        for (StringList::Iterator i(paths); i; i.next()) {
+            total += rebasePath("/home/user/project/common/units/u1/", i->string, out)[0];
+        }
+    }
+    report("rebasePath", count * repeat, now() - start);
+    uint64_t h = 0;
+    start = now();
+    for (int r = 0; r < repeat; r++) {
+        for (StringList::Iterator i(paths); i; i.next()) {
+            h += hash64(i->string, i->length);
+        }
+    }
+    report("hash64", count * repeat, now() - start);
+    total += int(h);
+
+    // Make dependency rule, as GCC writes it: a few paths per line, continued.
+    Blob rule;
+    const char* target = "s1.cpp.o: ";
+    rule.add(target, strlen(target));
+    int n = 0;
+    for (StringList::Iterator i(paths); i; i.next()) {
+        rule.add(i->string, i->length);
+        const char* separator = ++n % 3 ? " " : " \\\n ";
+        rule.add(separator, strlen(separator));
+    }
+    rule.add("", 1);
+    start = now();
+    for (int r = 0; r < repeat; r++) {
+        char* p = rule.data;
+        const char* name;
+        int length;
+        n = 0;
+        parseGccDepPath(p, name, length);
+        p++; // ':'
+        while (parseGccDepPath(p, name, length)) {
+            n++;
+        }
+        total += n;
+    }
+    report("parseGccDepPath", count * repeat, now() - start);
+    if (n != count || total == 0) {
+        say(logLevelError, "Unexpected path parsing results");
+    }
+}
+
+
+static long getPeakRss() { // KB.
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+
+// Memory taken by a large unit graph: a program including a header of each of
+// many units. Units have no sources, so only one file is compiled, but each
+// one gets its builder and configuration. Goes first, as peak RSS only grows.
+void benchUnitGraph() {
+    const int count = 5000;
+    char top[maxPath];
+    snprintf(top, sizeof(top), "/tmp/cx.microbench.%d/", int(getpid()));
+    char path[maxPath];
+    Blob source;
+    for (int i = 0; i < count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "u%d/", i);
+        makeDirectories(catPath(top, name, path));
+        catPath(path, "h.h", path);
+        char text[64];
+        int length = snprintf(text, sizeof(text), "int f%d();\n", i);
+        ::save(path, text, length);
+        length = snprintf(text, sizeof(text), "#include \"u%d/h.h\"\n", i);
+        source.add(text, length);
+        if (i % 2) {
+            // Half of them configured.
+            const char* unitConfig = "cc_options: -O2 -g -DUNIT\ncxx_options: -std=c++17\n";
+            catPath(top, name, path);
+            ::save(catPath(path, "cx.unit", path), unitConfig, strlen(unitConfig));
+        }
+    }
+    const char* mainText = "int main() { return 0; }\n";
+    source.add(mainText, strlen(mainText));
+    makeDirectories(catPath(top, "prog/", path));
+    source.save(catPath(path, "main.cpp", path));
+    long rssBefore = getPeakRss();
+    double start = now();
+    int savedLogLevel = logLevel;
+    logLevel = logLevelError;
+    {
+        Builder builder;
+        builder.options.skipRunning = true;
+        if (!builder.build(catPath(top, "prog/", path))) {
+            say(logLevelError, "Failed to build %s", path);
+        }
+    }
+    logLevel = savedLogLevel;
+    double seconds = now() - start;
+    long rss = getPeakRss() - rssBefore;
+    say(logLevelInfo, "%-40s %10.1f ms %9ld KB peak RSS, %.1f KB/unit",
+        "Unit graph: 5000 units", seconds * 1e3, rss, double(rss) / count);
+    removeDirectory(top);
+}
+
+
+#define RUN(WHAT) do { \
+    say(logLevelInfo, "Benchmarking %s (%d threads)", #WHAT, maxThreads); \
+    WHAT(); \
+} while (0)
+
+void microbench() {
+    RUN(benchUnitGraph);
+    RUN(benchBatchThroughput);
+    RUN(benchFileStateDict);
+    RUN(benchContainers);
+    RUN(benchDependencies);
+    RUN(benchPaths);
+}
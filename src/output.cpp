@@ -7,6 +7,15 @@
 int logLevel = logLevelInfo;
 
 static std::mutex outputMutex;
+static bool progressShown = false; // Guarded by outputMutex.
+
+
+static void eraseProgress() {
+    if (progressShown) {
+        fputs("\r\x1b[K", stderr);
+        progressShown = false;
+    }
+}
 
 
 const char* emColor   = "\x1b[1m";
@@ -35,6 +44,7 @@ static const char* suffix[3] = { "", "", "", };
 
 void say(int level, const char* format, ...) {
     std::lock_guard<std::mutex> lock(outputMutex);
+    eraseProgress();
     fprintf(stderr, "%s", prefix[level]);
     va_list args;
     va_start(args, format);
@@ -45,10 +55,22 @@ void say(int level, const char* format, ...) {
 
 
 static Blob output;
+static thread_local StringList* capturedErrors = nullptr;
+
+
+ErrorCapture::ErrorCapture(StringList* list): previous(capturedErrors) {
+    if (list) {
+        capturedErrors = list;
+    }
+}
+
+
+ErrorCapture::~ErrorCapture() {
+    capturedErrors = previous;
+}
 
 
 void delayedError(const char* format, ...) {
-    std::lock_guard<std::mutex> lock(outputMutex);
     char* buf = new char[8 * 1024];
     char* p = buf;
     p += sprintf(p, "%s", prefix[logLevelError]);
@@ -56,7 +78,14 @@ void delayedError(const char* format, ...) {
     va_start(args, format);
     p += vsprintf(p, format, args);
     va_end(args);
-    p += sprintf(p, "%s\n", suffix[logLevelError]);
+    p += sprintf(p, "%s", suffix[logLevelError]);
+    if (capturedErrors) {
+        capturedErrors->add(buf, p - buf);
+        delete[] buf;
+        return;
+    }
+    *p++ = '\n';
+    std::lock_guard<std::mutex> lock(outputMutex);
     int len = p - buf;
     p = output.growBy(len);
     memcpy(p, buf, len);
@@ -64,6 +93,12 @@ void delayedError(const char* format, ...) {
 }
 
 void delayedError(StringList& list) {
+    if (capturedErrors) {
+        for (StringList::Iterator i(list); i; i.next()) {
+            capturedErrors->add(i->string, i->length);
+        }
+        return;
+    }
     std::lock_guard<std::mutex> lock(outputMutex);
     for (StringList::Iterator i(list); i && output.size < 1024 * 1024; i.next()) {
         char* p = output.growBy(i->length + 1);
@@ -74,6 +109,7 @@ void delayedError(StringList& list) {
 
 void delayedErrorFlush() {
     std::lock_guard<std::mutex> lock(outputMutex);
+    eraseProgress();
     fwrite(output.data, output.size, 1, stderr);
     output.clear();
 }
@@ -81,12 +117,36 @@ void delayedErrorFlush() {
 
 void printOutput(StringList& list) {
     std::lock_guard<std::mutex> lock(outputMutex);
+    eraseProgress();
     for (StringList::Iterator i(list); i; i.next()) {
         fprintf(stderr, "%s\n", i->string);
     }
 }
 
 
+void progress(const char* format, ...) {
+    static bool isTerminal = isatty(fileno(stderr));
+    if (!isTerminal) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(outputMutex);
+    fputs("\r", stderr);
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputs("\x1b[K", stderr);
+    fflush(stderr);
+    progressShown = true;
+}
+
+
+void progressClear() {
+    std::lock_guard<std::mutex> lock(outputMutex);
+    eraseProgress();
+}
+
+
 bool colorEnabled = false;
 
 
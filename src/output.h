@@ -9,6 +9,19 @@ void delayedError(StringList&);
 void delayedErrorFlush();
 void printOutput(StringList&);
 
+// While in scope, delayed errors of this thread go to the list instead, for work
+// that may turn out not to be needed. Null list captures nothing.
+class ErrorCapture {
+public:
+    explicit ErrorCapture(StringList*);
+    ~ErrorCapture();
+    ErrorCapture(const ErrorCapture&) = delete;
+    ErrorCapture& operator=(const ErrorCapture&) = delete;
+
+private:
+    StringList* previous;
+};
+
 enum {
     logLevelError,
     logLevelInfo,
@@ -19,6 +32,11 @@ void say(int level, const char* format, ...);
 
 extern int logLevel;
 
+// Transient status line, if stderr is a terminal. Replaced by the next one,
+// and erased before any other output.
+void progress(const char* format, ...);
+void progressClear();
+
 #define LOG(level, ...) do { \
     if ((level) <= logLevel) { \
         say(level, __VA_ARGS__); \
@@ -0,0 +1,537 @@
+#include "profiler.h"
+#include "output.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <elf.h>
+#include <cxxabi.h>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+// Report only, STL is hidden here.
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+
+
+static const int ringPages = 16; // Power of 2. Per CPU, they are locked in memory.
+
+
+struct Mapping {
+    uint64_t pid;
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset; // In the file.
+    uint64_t path; // In paths.
+};
+
+
+// Record layouts, for the attributes used.
+struct SampleRecord {
+    perf_event_header header;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t count; // Of the call chain.
+    uint64_t ips[1];
+};
+
+struct MmapRecord {
+    perf_event_header header;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t addr;
+    uint64_t length;
+    uint64_t offset;
+    char path[1];
+};
+
+struct LostRecord {
+    perf_event_header header;
+    uint64_t id;
+    uint64_t count;
+};
+
+
+// Function symbols of an ELF file, and its loadable segments, to map file
+// offsets to addresses.
+class SymbolTable {
+public:
+    bool load(const char* path);
+    const char* find(uint64_t offset) const; // Symbol at the file offset.
+
+private:
+    struct Symbol {
+        uint64_t address;
+        uint64_t end;
+        std::string name;
+        bool operator<(const Symbol& other) const { return address < other.address; }
+    };
+    struct Segment {
+        uint64_t offset;
+        uint64_t size;
+        uint64_t address;
+    };
+    std::vector<Symbol> symbols;
+    std::vector<Segment> segments;
+    void addSymbols(const Blob& file, const Elf64_Shdr* sections, int type);
+};
+
+
+bool SymbolTable::load(const char* path) {
+    Blob file;
+    if (!file.load(path) || file.size < int(sizeof(Elf64_Ehdr))) {
+        return false;
+    }
+    const Elf64_Ehdr* header = (const Elf64_Ehdr*)file.data;
+    if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64 ||
+        header->e_phoff + uint64_t(header->e_phnum) * sizeof(Elf64_Phdr) > uint64_t(file.size) ||
+        header->e_shoff + uint64_t(header->e_shnum) * sizeof(Elf64_Shdr) > uint64_t(file.size))
+    {
+        return false;
+    }
+    const Elf64_Phdr* programHeaders = (const Elf64_Phdr*)(file.data + header->e_phoff);
+    for (int i = 0; i < header->e_phnum; i++) {
+        const Elf64_Phdr& h = programHeaders[i];
+        if (h.p_type == PT_LOAD) {
+            segments.push_back(Segment{h.p_offset, h.p_filesz, h.p_vaddr});
+        }
+    }
+    const Elf64_Shdr* sections = (const Elf64_Shdr*)(file.data + header->e_shoff);
+    addSymbols(file, sections, SHT_SYMTAB);
+    if (symbols.empty()) { // Stripped.
+        addSymbols(file, sections, SHT_DYNSYM);
+    }
+    std::sort(symbols.begin(), symbols.end());
+    return true;
+}
+
+
+void SymbolTable::addSymbols(const Blob& file, const Elf64_Shdr* sections, int type) {
+    const Elf64_Ehdr* header = (const Elf64_Ehdr*)file.data;
+    for (int i = 0; i < header->e_shnum; i++) {
+        const Elf64_Shdr& s = sections[i];
+        if (int(s.sh_type) != type || s.sh_link >= header->e_shnum) {
+            continue;
+        }
+        const Elf64_Shdr& names = sections[s.sh_link];
+        if (s.sh_offset + s.sh_size > uint64_t(file.size) || names.sh_offset + names.sh_size > uint64_t(file.size)) {
+            continue;
+        }
+        const Elf64_Sym* begin = (const Elf64_Sym*)(file.data + s.sh_offset);
+        const Elf64_Sym* end = begin + s.sh_size / sizeof(Elf64_Sym);
+        for (const Elf64_Sym* sym = begin; sym < end; sym++) {
+            if (ELF64_ST_TYPE(sym->st_info) != STT_FUNC || sym->st_value == 0 || sym->st_name >= names.sh_size) {
+                continue;
+            }
+            // Symbols without size (some assembly) cover the rest of their section.
+            uint64_t end = sym->st_value + sym->st_size;
+            if (!sym->st_size) {
+                if (sym->st_shndx >= header->e_shnum) {
+                    continue;
+                }
+                end = sections[sym->st_shndx].sh_addr + sections[sym->st_shndx].sh_size;
+            }
+            const char* name = file.data + names.sh_offset + sym->st_name;
+            int status = 0;
+            char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+            symbols.push_back(Symbol{sym->st_value, end, demangled ? demangled : name});
+            free(demangled);
+        }
+    }
+}
+
+
+const char* SymbolTable::find(uint64_t offset) const {
+    uint64_t address = 0;
+    bool found = false;
+    for (const Segment& s: segments) {
+        if (offset >= s.offset && offset < s.offset + s.size) {
+            address = offset - s.offset + s.address;
+            found = true;
+            break;
+        }
+    }
+    if (!found) {
+        return nullptr;
+    }
+    Symbol key{address, 0, std::string()};
+    std::vector<Symbol>::const_iterator i = std::upper_bound(symbols.begin(), symbols.end(), key);
+    if (i == symbols.begin()) {
+        return nullptr;
+    }
+    --i;
+    if (address >= i->end) {
+        return nullptr;
+    }
+    return i->name.c_str();
+}
+
+
+Sampler::~Sampler() {
+    for (int i = 0; i < cpuCount; i++) {
+        if (rings[i]) {
+            munmap(rings[i], ringSize + getpagesize());
+        }
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    delete[] fds;
+    delete[] rings;
+}
+
+
+bool Sampler::attach(int pid) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_CPU_CLOCK;
+    attr.freq = 1;
+    attr.sample_freq = frequency;
+    attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+    attr.mmap = 1;
+    attr.inherit = 1; // Threads and child processes.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.exclude_callchain_kernel = 1;
+    long pageSize = getpagesize();
+    ringSize = ringPages * pageSize;
+    cpuCount = sysconf(_SC_NPROCESSORS_CONF);
+    fds = new int[cpuCount];
+    rings = new char*[cpuCount];
+    for (int i = 0; i < cpuCount; i++) {
+        fds[i] = -1;
+        rings[i] = nullptr;
+    }
+    int opened = 0;
+    for (int i = 0; i < cpuCount; i++) {
+        fds[i] = syscall(SYS_perf_event_open, &attr, pid, i, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fds[i] < 0) {
+            if (errno == ENODEV) {
+                continue; // Offline.
+            }
+            FAILURE("Cannot sample the program: perf_event_open: %s (see /proc/sys/kernel/perf_event_paranoid)", strerror(errno));
+            return false;
+        }
+        void* p = mmap(nullptr, ringSize + pageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+        if (p == MAP_FAILED) {
+            FAILURE("Cannot map sample buffer: %s", strerror(errno));
+            return false;
+        }
+        rings[i] = (char*)p;
+        opened++;
+    }
+    return opened > 0;
+}
+
+
+void Sampler::poll() {
+    for (int i = 0; i < cpuCount; i++) {
+        if (rings[i]) {
+            poll(rings[i]);
+        }
+    }
+}
+
+
+void Sampler::poll(char* ring) {
+    perf_event_mmap_page* header = (perf_event_mmap_page*)ring;
+    const char* data = ring + getpagesize();
+    uint64_t head = __atomic_load_n(&header->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = header->data_tail;
+    Blob record;
+    while (tail < head) {
+        const perf_event_header* h = (const perf_event_header*)(data + tail % ringSize);
+        int size = h->size;
+        if (size < int(sizeof(perf_event_header))) {
+            break;
+        }
+        // Records may wrap around the end of the ring.
+        record.clear();
+        int first = ringSize - tail % ringSize;
+        if (first >= size) {
+            record.add(data + tail % ringSize, size);
+        }
+        else {
+            record.add(data + tail % ringSize, first);
+            record.add(data, size - first);
+        }
+        addRecord(record.data);
+        tail += size;
+    }
+    __atomic_store_n(&header->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+
+void Sampler::addRecord(const char* data) {
+    const perf_event_header* header = (const perf_event_header*)data;
+    if (header->type == PERF_RECORD_SAMPLE) {
+        const SampleRecord* r = (const SampleRecord*)data;
+        uint64_t pid = r->pid;
+        uint64_t depth = 0;
+        int start = stacks.size;
+        stacks.add(&pid, sizeof(pid));
+        stacks.add(&depth, sizeof(depth));
+        for (uint64_t i = 0; i < r->count; i++) {
+            if (r->ips[i] >= uint64_t(PERF_CONTEXT_MAX)) {
+                continue; // Context marker.
+            }
+            stacks.add(&r->ips[i], sizeof(uint64_t));
+            depth++;
+        }
+        ((uint64_t*)(stacks.data + start))[1] = depth;
+        sampleCount++;
+    }
+    else if (header->type == PERF_RECORD_MMAP) {
+        const MmapRecord* r = (const MmapRecord*)data;
+        if (r->path[0] != '/') {
+            return; // Anonymous, [vdso], etc.
+        }
+        Mapping m = {r->pid, r->addr, r->addr + r->length, r->offset, uint64_t(paths.size)};
+        paths.add(r->path, strlen(r->path) + 1);
+        mappings.add(&m, sizeof(m));
+    }
+    else if (header->type == PERF_RECORD_LOST) {
+        lostCount += int(((const LostRecord*)data)->count);
+    }
+}
+
+
+void Sampler::report(int top, const char* foldedPath) {
+    if (sampleCount == 0) {
+        INFO("No samples");
+        return;
+    }
+    const Mapping* maps = (const Mapping*)mappings.data;
+    int mapCount = mappings.size / sizeof(Mapping);
+    std::map<std::string, SymbolTable> tables;
+    std::map<std::pair<uint64_t, uint64_t>, std::string> names; // By pid and address.
+    // Processes forked without exec have no mappings of their own, parent's are used.
+    uint64_t rootPid = mapCount ? maps[0].pid : 0;
+    auto symbolize = [&](uint64_t pid, uint64_t address) -> const std::string& {
+        std::string& name = names[std::make_pair(pid, address)];
+        if (!name.empty()) {
+            return name;
+        }
+        const Mapping* found = nullptr;
+        for (int pass = 0; pass < 2 && !found; pass++) {
+            uint64_t p = pass ? rootPid : pid;
+            // The latest one wins, earlier ones may have been unmapped since.
+            for (int i = mapCount - 1; i >= 0; i--) {
+                if (maps[i].pid == p && address >= maps[i].start && address < maps[i].end) {
+                    found = maps + i;
+                    break;
+                }
+            }
+        }
+        if (!found) {
+            name = "[unknown]";
+            return name;
+        }
+        const char* path = paths.data + found->path;
+        std::map<std::string, SymbolTable>::iterator t = tables.find(path);
+        if (t == tables.end()) {
+            t = tables.insert(std::make_pair(std::string(path), SymbolTable())).first;
+            t->second.load(path);
+        }
+        const char* symbol = t->second.find(address - found->start + found->offset);
+        if (symbol) {
+            name = symbol;
+        }
+        else {
+            const char* slash = strrchr(path, '/');
+            name = std::string("[") + (slash ? slash + 1 : path) + "]";
+        }
+        return name;
+    };
+    std::map<std::string, int> self;
+    std::map<std::string, int> total;
+    std::map<std::string, int> folded;
+    const uint64_t* p = (const uint64_t*)stacks.data;
+    const uint64_t* end = (const uint64_t*)(stacks.data + stacks.size);
+    while (p < end) {
+        uint64_t pid = p[0];
+        int depth = int(p[1]);
+        const uint64_t* ips = p + 2;
+        p += 2 + depth;
+        if (depth == 0) {
+            continue;
+        }
+        std::vector<const std::string*> frames;
+        for (int i = 0; i < depth; i++) {
+            // Return addresses point after the call, which may be past the end of the caller.
+            frames.push_back(&symbolize(pid, i ? ips[i] - 1 : ips[i]));
+        }
+        self[*frames[0]]++;
+        std::vector<const std::string*> seen;
+        std::string stack;
+        for (int i = depth - 1; i >= 0; i--) {
+            if (std::find_if(seen.begin(), seen.end(), [&](const std::string* s) { return *s == *frames[i]; }) == seen.end()) {
+                seen.push_back(frames[i]);
+                total[*frames[i]]++;
+            }
+            if (!stack.empty()) {
+                stack += ';';
+            }
+            stack += *frames[i];
+        }
+        folded[stack]++;
+    }
+    std::vector<std::pair<int, std::string>> sorted;
+    for (std::map<std::string, int>::const_iterator i = self.begin(); i != self.end(); ++i) {
+        sorted.push_back(std::make_pair(i->second, i->first));
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<int, std::string>& a, const std::pair<int, std::string>& b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    INFO("%s%d samples%s (%d Hz)%s", em, sampleCount, noem, frequency, lostCount ? ", some lost" : "");
+    INFO("  %7s %7s  %s", "self", "total", "function");
+    for (int i = 0; i < int(sorted.size()) && i < top; i++) {
+        INFO("  %6.1f%% %6.1f%%  %s", sorted[i].first * 100.0 / sampleCount,
+            total[sorted[i].second] * 100.0 / sampleCount, sorted[i].second.c_str());
+    }
+    Blob text;
+    for (std::map<std::string, int>::const_iterator i = folded.begin(); i != folded.end(); ++i) {
+        char count[32];
+        text.add(i->first.data(), i->first.size());
+        text.add(count, sprintf(count, " %d\n", i->second));
+    }
+    if (text.save(foldedPath)) {
+        INFO("Folded stacks: %s", foldedPath);
+    }
+    else {
+        FAILURE("Cannot save %s", foldedPath);
+    }
+}
+
+
+struct CounterEvent {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+};
+
+
+// Instructions go first, see Counters::getInstructions().
+static const CounterEvent counterEvents[] = {
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"L1D misses", PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"LLC misses", PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+
+// With thousands separated.
+static const char* formatCount(int64_t n, char* text) {
+    char digits[32];
+    int length = sprintf(digits, "%lld", (long long)n);
+    char* p = text;
+    for (int i = 0; i < length; i++) {
+        if (i && (length - i) % 3 == 0) {
+            *p++ = ',';
+        }
+        *p++ = digits[i];
+    }
+    *p = 0;
+    return text;
+}
+
+
+Counters::~Counters() {
+    for (int i = 0; i < maxEvents; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
+
+
+bool Counters::attach(int pid) {
+    static_assert(sizeof(counterEvents) / sizeof(counterEvents[0]) == maxEvents, "counterEvents");
+    int count = instructionsOnly ? 1 : maxEvents;
+    int opened = 0;
+    for (int i = 0; i < count; i++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counterEvents[i].type;
+        attr.config = counterEvents[i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.inherit = 1; // Threads and child processes.
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[i] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fds[i] >= 0) {
+            opened++;
+        }
+        else if (errno != ENOENT && errno != EOPNOTSUPP && errno != ENODEV) {
+            FAILURE("Cannot count %s: perf_event_open: %s (see /proc/sys/kernel/perf_event_paranoid)",
+                counterEvents[i].name, strerror(errno));
+            return false;
+        }
+        else {
+            TRACE("Not supported: %s", counterEvents[i].name);
+        }
+    }
+    if (!opened) {
+        FAILURE(instructionsOnly ? "Instructions cannot be counted here, no hardware counters" : "None of the counters are supported");
+        return false;
+    }
+    return true;
+}
+
+
+void Counters::read() {
+    for (int i = 0; i < maxEvents; i++) {
+        uint64_t data[3]; // Value, time enabled, time running.
+        if (fds[i] < 0 || ::read(fds[i], data, sizeof(data)) != sizeof(data)) {
+            continue;
+        }
+        if (data[2] == 0) { // Never scheduled on the PMU.
+            values[i] = data[1] == 0 ? 0 : -1;
+            fractions[i] = 1;
+            continue;
+        }
+        fractions[i] = double(data[2]) / data[1];
+        values[i] = data[2] < data[1] ? int64_t(double(data[0]) / fractions[i]) : int64_t(data[0]);
+    }
+}
+
+
+void Counters::print() const {
+    for (int i = 0; i < maxEvents; i++) {
+        if (instructionsOnly && i > 0) {
+            break;
+        }
+        char count[40];
+        if (values[i] < 0) {
+            INFO("  %-14s %20s", counterEvents[i].name, fds[i] < 0 ? "not supported" : "not counted");
+            continue;
+        }
+        formatCount(values[i], count);
+        if (fractions[i] < 0.999) {
+            INFO("  %-14s %20s  (scaled, counted %.0f%% of the time)", counterEvents[i].name, count, fractions[i] * 100);
+        }
+        else if (i >= 2 && i <= 4 && values[0] > 0) {
+            INFO("  %-14s %20s  (%.2f per 1000 instructions)", counterEvents[i].name, count, values[i] * 1000.0 / values[0]);
+        }
+        else {
+            INFO("  %-14s %20s", counterEvents[i].name, count);
+        }
+        if (i == 1 && values[0] >= 0 && values[1] > 0) {
+            INFO("  %-14s %20.2f", "IPC", double(values[0]) / values[1]);
+        }
+    }
+}
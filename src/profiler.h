@@ -0,0 +1,62 @@
+#pragma once
+
+#include "lists.h"
+
+// Sampling profiler (see --profile). Call stacks of a process, its threads
+// and children are sampled by the kernel (perf_event_open, CPU clock, user
+// space only, frame pointers), then symbolized with symbol tables of the
+// executable and shared libraries, as mapped at the time.
+class Sampler {
+public:
+    int frequency = 1000; // Samples per second of CPU time.
+    Sampler() {}
+    Sampler(const Sampler&) = delete;
+    Sampler& operator=(const Sampler&) = delete;
+    ~Sampler();
+    // The process should not have exec'ed yet (see Runner::held), so that
+    // mappings of the program are seen.
+    bool attach(int pid);
+    void poll(); // Take what's in the ring buffer, before it overflows.
+    int getSampleCount() const { return sampleCount; }
+    int getLostCount() const { return lostCount; }
+    // Flat profile, the top functions by self time, with totals. Also writes
+    // folded stacks ("main;f;g 42" lines, as flamegraph tools take them).
+    void report(int top, const char* foldedPath);
+
+private:
+    // Inherited events can't be mapped per process, only per CPU.
+    int cpuCount = 0;
+    int* fds = nullptr;
+    char** rings = nullptr; // Header page, then the ring buffer.
+    long ringSize = 0; // Without the header page.
+    int sampleCount = 0;
+    int lostCount = 0;
+    Blob stacks; // Per sample: pid, depth, then addresses, leaf first. All uint64_t.
+    Blob mappings; // Executable mappings of files, see Mapping.
+    Blob paths; // Their paths, zero-terminated.
+    void poll(char* ring);
+    void addRecord(const char* record);
+};
+
+
+// Event counts of a process, its threads and children (see --counters), in
+// user space. Hardware ones may be unsupported, e.g. in virtual machines.
+class Counters {
+public:
+    bool instructionsOnly = false;
+    Counters() {}
+    Counters(const Counters&) = delete;
+    Counters& operator=(const Counters&) = delete;
+    ~Counters();
+    // Like Sampler::attach(). Counting starts when the process exec's.
+    bool attach(int pid);
+    void read(); // After the process and its children exit.
+    void print() const;
+    int64_t getInstructions() const { return values[0]; } // -1 if not counted.
+
+private:
+    enum { maxEvents = 6 };
+    int fds[maxEvents] = {-1, -1, -1, -1, -1, -1};
+    int64_t values[maxEvents] = {-1, -1, -1, -1, -1, -1};
+    double fractions[maxEvents] = {}; // Of time counted, if multiplexed.
+};
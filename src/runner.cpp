@@ -4,15 +4,79 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/personality.h>
+#include <sched.h>
 
 #include <cstdio>
 #include <cstdlib>
+#include <cerrno>
+#include <ctime>
 #include <vector>
+#include <mutex>
+#include <atomic>
+
+
+// Processes of run(), each in its own group, so it can be killed with all its
+// children (like cc1plus and as, started by gcc). Fixed slots, so that signal
+// handlers can walk them.
+static constexpr int maxRunning = 1024;
+static std::atomic<int> running[maxRunning];
+static std::mutex runningMutex; // Starting vs cancelling.
+static bool cancelled = false; // Guarded by runningMutex.
+
+
+static void addRunning(int pid) {
+    for (int i = 0; i < maxRunning; i++) {
+        int expected = 0;
+        if (running[i].compare_exchange_strong(expected, pid)) {
+            return;
+        }
+    }
+}
+
+
+static void removeRunning(int pid) {
+    for (int i = 0; i < maxRunning; i++) {
+        int expected = pid;
+        if (running[i].compare_exchange_strong(expected, 0)) {
+            return;
+        }
+    }
+}
+
+
+void Runner::signalAll(int signal) {
+    for (int i = 0; i < maxRunning; i++) {
+        if (int pid = running[i].load()) {
+            kill(-pid, signal);
+        }
+    }
+}
+
+
+void Runner::cancelAll() {
+    std::lock_guard<std::mutex> lock(runningMutex);
+    cancelled = true;
+    signalAll(SIGTERM);
+}
+
+
+void Runner::resume() {
+    std::lock_guard<std::mutex> lock(runningMutex);
+    cancelled = false;
+}
+
 
 Runner::Runner() {}
 
-Runner::~Runner() {}
+Runner::~Runner() {
+    stop();
+    release();
+}
 
 static bool haveDir(const char* dir) {
     return dir && *dir && !(dir[0] == '.' && (dir[1] == 0 || (dir[1] == '/' && dir[2] == 0)));
@@ -28,10 +92,7 @@ static const char** prepareArgs(const StringList& args, const char* dir) {
             text.add(i->string, i->length);
             text.add(" ", 1);
         }
-        text.data[text.size] = 0;
-        if (text.size) {
-            text.size--;
-        }
+        text.data[text.size - 1] = 0; // Trailing space. There is at least one argument.
         if (haveDir(dir)) {
             TRACE("Running in %s: %s", dir, text.data);
         }
@@ -64,51 +125,262 @@ void Runner::exec() {
 }
 
 
+static int64_t getMilliseconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int64_t(t.tv_sec) * 1000 + t.tv_nsec / 1000000;
+}
+
+
+// Close-on-exec, so pipes of other jobs, started concurrently, don't leak
+// into this child and delay the end of its output.
+static bool openPipe(int* fd) {
+    return pipe2(fd, O_CLOEXEC) == 0;
+}
+
+
 bool Runner::run() {
     output.clear();
+    sideOutput.clear();
+    timedOut = false;
     if (args.isEmpty()) {
         return false;
     }
     int fd[2];
-    if (pipe(fd) == -1)  {
+    int side[2] = {-1, -1};
+    if (!openPipe(fd))  {
+        return false;
+    }
+    if (sideOutputFd >= 0 && !openPipe(side)) {
+        close(fd[0]);
+        close(fd[1]);
         return false;
     }
     const char** argPtrs = prepareArgs(args, currentDirectory);
-    pid_t pid = fork();
+    std::unique_lock<std::mutex> lock(runningMutex);
+    pid_t pid = cancelled ? -1 : fork();
     if (pid == -1) {
+        lock.unlock();
         close(fd[0]);
         close(fd[1]);
+        if (side[0] >= 0) {
+            close(side[0]);
+            close(side[1]);
+        }
         delete[] argPtrs;
         return false;
     }
     if (pid == 0) {
-        // Child.
-        close(fd[0]);
+        // Child. Pipe ends we don't dup are closed by exec.
+        setpgid(0, 0); // So it can be killed with all its children.
         dup2(fd[1], 1);
         dup2(fd[1], 2);
-        close(fd[1]);
+        if (side[1] >= 0) {
+            if (side[1] == sideOutputFd) {
+                fcntl(side[1], F_SETFD, 0);
+            }
+            else {
+                dup2(side[1], sideOutputFd);
+            }
+        }
         doExec(argPtrs, currentDirectory);
     }
     else {
-        // Parent.
+        // Parent. The group is set here too, so it's there before anyone kills it.
+        setpgid(pid, pid);
+        addRunning(pid);
+        lock.unlock();
         close(fd[1]);
-        FILE* processOutput = fdopen(fd[0], "r");
-        char* line = nullptr;
-        size_t size = 0;
-        int length;
-        while ((length = getline(&line, &size, processOutput)) != -1) {
-            if (length && line[length - 1] == '\n') {
-                length--;
+        if (side[1] >= 0) {
+            close(side[1]);
+        }
+        Blob text;
+        struct pollfd p[2];
+        Blob* sinks[2] = {&text, &sideOutput};
+        p[0].fd = fd[0];
+        p[1].fd = side[0];
+        p[0].events = p[1].events = POLLIN;
+        int openCount = side[0] >= 0 ? 2 : 1;
+        int64_t deadline = timeout > 0 ? getMilliseconds() + int64_t(timeout) * 1000 : 0;
+        while (openCount > 0) {
+            int wait = -1;
+            if (deadline) {
+                int64_t left = deadline - getMilliseconds();
+                wait = left > 0 ? int(left) : 0;
+            }
+            int ready = poll(p, 2, wait);
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready == 0) {
+                kill(-pid, SIGKILL);
+                kill(pid, SIGKILL);
+                timedOut = true;
+                break;
+            }
+            if (ready < 0) {
+                break;
+            }
+            for (int i = 0; i < 2; i++) {
+                if (p[i].fd < 0 || !p[i].revents) {
+                    continue;
+                }
+                const int chunk = 4096;
+                Blob& sink = *sinks[i];
+                int size = sink.size;
+                int n = read(p[i].fd, sink.growBy(chunk), chunk);
+                sink.size = size + (n > 0 ? n : 0);
+                if (n == 0 || (n < 0 && errno != EINTR)) {
+                    close(p[i].fd);
+                    p[i].fd = -1; // Ignored by poll().
+                    openCount--;
+                }
             }
-            output.add(line, length);
         }
-        free(line);
-        fclose(processOutput);
-        waitpid(pid, &exitStatus, 0);
+        for (int i = 0; i < 2; i++) {
+            if (p[i].fd >= 0) {
+                close(p[i].fd);
+            }
+        }
+        // Output may be closed before the program is done, the deadline still holds.
+        bool reaped = false;
+        while (deadline && !timedOut) {
+            int result = waitpid(pid, &exitStatus, WNOHANG);
+            if (result == pid || (result < 0 && errno != EINTR)) {
+                reaped = result == pid;
+                break;
+            }
+            if (getMilliseconds() >= deadline) {
+                kill(-pid, SIGKILL);
+                kill(pid, SIGKILL);
+                timedOut = true;
+                break;
+            }
+            poll(nullptr, 0, 10);
+        }
+        while (!reaped && waitpid(pid, &exitStatus, 0) < 0 && errno == EINTR) {
+        }
+        removeRunning(pid);
         //exitStatus = WIFEXITED(exitStatus) ? WEXITSTATUS(exitStatus) : -1;
+        const char* line = text.data;
+        const char* end = text.data + text.size;
+        for (const char* p = line; p < end; p++) {
+            if (*p == '\n') {
+                output.add(line, p - line);
+                line = p + 1;
+            }
+        }
+        if (line < end) {
+            output.add(line, end - line);
+        }
+    }
+    delete[] argPtrs;
+    lock.lock();
+    return !cancelled; // If killed by cancelAll(), its failure is not an error.
+}
+
+
+bool Runner::start() {
+    stop();
+    if (args.isEmpty()) {
+        return false;
+    }
+    const char** argPtrs = prepareArgs(args, currentDirectory);
+    int holdPipe[2] = {-1, -1};
+    if (held && !openPipe(holdPipe)) {
+        delete[] argPtrs;
+        return false;
+    }
+    pid = fork();
+    if (pid == 0) {
+        if (held) {
+            char c;
+            close(holdPipe[1]);
+            while (read(holdPipe[0], &c, 1) < 0 && errno == EINTR) {
+            }
+            close(holdPipe[0]);
+        }
+        if (cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+                PANIC("Cannot pin to CPU %d", cpu);
+            }
+        }
+        if (noAslr) {
+            personality(personality(0xffffffff) | ADDR_NO_RANDOMIZE);
+        }
+        if (quiet) {
+            int fd = open("/dev/null", O_WRONLY);
+            dup2(fd, 1);
+            dup2(fd, 2);
+            close(fd);
+        }
+        doExec(argPtrs, currentDirectory);
     }
     delete[] argPtrs;
+    if (held) {
+        close(holdPipe[0]);
+        holdFd = holdPipe[1];
+    }
+    if (pid == -1) {
+        pid = 0;
+        release();
+        return false;
+    }
+    return true;
+}
+
+
+// Closing the pipe lets the held child go on.
+void Runner::release() {
+    if (holdFd >= 0) {
+        close(holdFd);
+        holdFd = -1;
+    }
+}
+
+
+bool Runner::isRunning() {
+    if (pid && waitpid(pid, &exitStatus, WNOHANG) == pid) {
+        pid = 0;
+    }
+    return pid != 0;
+}
+
+
+bool Runner::wait() {
+    if (!pid) {
+        return false;
+    }
+    struct rusage usage;
+    int result;
+    while ((result = wait4(pid, &exitStatus, 0, &usage)) < 0 && errno == EINTR) {
+    }
+    if (result != pid) {
+        pid = 0;
+        return false;
+    }
+    cpuTime = (int64_t(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * 1000000000 +
+        (int64_t(usage.ru_utime.tv_usec) + usage.ru_stime.tv_usec) * 1000;
+    pid = 0;
     return true;
 }
 
 
+// Ask politely, then kill.
+void Runner::stop() {
+    if (!isRunning()) {
+        return;
+    }
+    kill(pid, SIGTERM);
+    for (int i = 0; i < 100 && isRunning(); i++) {
+        usleep(10 * 1000);
+    }
+    if (isRunning()) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &exitStatus, 0);
+        pid = 0;
+    }
+}
@@ -8,10 +8,37 @@ public:
     StringList args;
     StringList output;
     int exitStatus = 0;
+    int timeout = 0; // Seconds. If exceeded, the process (group) is killed.
+    bool timedOut = false;
+    // If set, the process gets one more pipe, at this descriptor, and what it
+    // writes there ends up in sideOutput. Like "-MF /dev/fd/3" for dependencies.
+    int sideOutputFd = -1;
+    Blob sideOutput;
+    // For start() only.
+    int cpu = -1; // If not negative, pin the process to this CPU.
+    bool noAslr = false; // Disable address space layout randomization.
+    bool quiet = false; // Discard output.
+    bool held = false; // The child waits before exec, until release(). E.g. to attach to it.
+    int64_t cpuTime = 0; // User and system, nanoseconds, set by wait().
     Runner();
     ~Runner();
     bool run();
     void exec();
+    // Run in background, with output not captured.
+    bool start();
+    bool wait(); // For the one started in background.
+    void release();
+    int getPid() const { return pid; }
+    void stop();
+    bool isRunning();
+    // Kill processes being run by run(), in all threads, with their children.
+    // Further run() calls fail, until resumed.
+    static void cancelAll();
+    static void resume();
+    // Send the signal to them. Async-signal-safe.
+    static void signalAll(int signal);
 private:
+    int pid = 0;
+    int holdFd = -1;
 };
 
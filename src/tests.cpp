@@ -6,6 +6,9 @@
 #include <cstring>
 #include <cstdlib>
 #include <cstdio>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
 
 #include "output.h"
 #include "dirs.h"
@@ -13,6 +16,12 @@
 #include "compiler.h"
 #include "config.h"
 #include "async.h"
+#include "runner.h"
+#include "hash.h"
+#include "history.h"
+#include "timereport.h"
+#include "impact.h"
+#include "bench.h"
 
 
 void testDirFunc() {
@@ -117,6 +126,10 @@ void testFileStateList() {
 void testFileStateDict() {
     FileStateDict dict;
     FileStateDict::Entry* entry;
+    // Empty ones share their hash table.
+    assert(!dict.find("key"));
+    dict.clear();
+    assert(!dict.find("key"));
 
     char name[64];
     for (int i = 0; i < 1000; i++) {
@@ -138,6 +151,15 @@ void testFileStateDict() {
         assert(strcmp(i->string, name) == 0);
     }
     assert(!i);
+
+    // Copies have their own data.
+    StringList list;
+    list.add("abc");
+    StringList copy(list);
+    list.clear();
+    list.add("xyz");
+    StringList::Iterator c(copy);
+    assert(c && strcmp(c->string, "abc") == 0);
 }
 
 
@@ -158,6 +180,22 @@ void testFileType() {
 }
 
 
+void testGccDeps() {
+    char text[] = "a.o: a.cpp /usr/include/stdio.h \\\n  b\\ c.h \\\r\n d.h\n";
+    char* p = text;
+    const char* name;
+    int length;
+    assert(parseGccDepPath(p, name, length) && length == 3 && memcmp(name, "a.o", 3) == 0);
+    assert(*p == ':');
+    p++;
+    assert(parseGccDepPath(p, name, length) && length == 5 && memcmp(name, "a.cpp", 5) == 0);
+    assert(parseGccDepPath(p, name, length) && length == 20 && memcmp(name, "/usr/include/stdio.h", 20) == 0);
+    assert(parseGccDepPath(p, name, length) && length == 5 && memcmp(name, "b c.h", 5) == 0);
+    assert(parseGccDepPath(p, name, length) && length == 3 && memcmp(name, "d.h", 3) == 0);
+    assert(!parseGccDepPath(p, name, length));
+}
+
+
 void testConfig() {
     const char* text =
         "# Comment\n"
@@ -191,6 +229,37 @@ void testConfig() {
 }
 
 
+void testHash() {
+    // Every byte counts, including the tail of the last word.
+    assert(hash64("0123456789abcdef", 16) != hash64("0123456789abcdeg", 16));
+    assert(hash64("0123456789a", 11) != hash64("0123456789b", 11));
+    assert(hash64("abc", 3) != hash64("abc\0", 4));
+    assert(hash64("") != 0);
+    assert(combineHash(1, 2) != combineHash(2, 1));
+    // List boundaries count.
+    StringList a;
+    a.add("-O2");
+    a.add("-g");
+    StringList b;
+    b.add("-O2-g");
+    StringList c;
+    c.add("-g");
+    c.add("-O2");
+    assert(getStringListHash(a) != getStringListHash(b));
+    assert(getStringListHash(a) != getStringListHash(c));
+
+    // Include search path is a part of options fingerprint.
+    Config x;
+    assert(x.parse("/a/cx.unit", "c_options: -O2\n"));
+    Config y;
+    assert(y.parse("/a/cx.unit", "c_options: -O2\ninclude_path: inc\n"));
+    assert(x.cOptionsTag != y.cOptionsTag);
+    assert(x.linkerOptionsTag == y.linkerOptionsTag);
+
+    assert(sizeof(DepsHeader) % FileStateListEntry::alignment == 0);
+}
+
+
 const int jobCount = 16;
 int jobInstanceCount = 0;
 
@@ -201,6 +270,154 @@ struct IncJob: public Job {
     void run() override { while (count < 10) count++; }
 };
 
+void testHistory() {
+    char path[maxPath];
+    snprintf(path, sizeof(path), "/tmp/cx.sanity.%d.history", int(getpid()));
+    deleteFile(path);
+    {
+        BuildHistory history;
+        assert(!history.load(path));
+        assert(history.estimate(BuildHistory::kindObject, "/a.cpp") == 0);
+        history.add(BuildHistory::kindObject, "/a.cpp", 100);
+        history.add(BuildHistory::kindObject, "/b.cpp", 300);
+        assert(history.save(path, 1, 400));
+        assert(history.isEmpty());
+        history.add(BuildHistory::kindObject, "/a.cpp", 150);
+        assert(history.save(path, 2, 150));
+    }
+    BuildHistory history;
+    assert(history.load(path));
+    assert(history.estimate(BuildHistory::kindObject, "/a.cpp") == 150); // Latest.
+    assert(history.estimate(BuildHistory::kindObject, "/b.cpp") == 300);
+    assert(history.estimate(BuildHistory::kindObject, "/c.cpp") == (100 + 300 + 150) / 3); // Average.
+    assert(history.estimate(BuildHistory::kindProgram, "/c") == 0);
+    // Compaction keeps the most recent records.
+    for (int i = 0; i < 2 * BuildHistory::maxRecords; i++) {
+        assert(history.load(path));
+        history.add(BuildHistory::kindLibrary, "/lib", 1000 + i);
+        assert(history.save(path, 3 + i, 1000));
+    }
+    assert(history.load(path));
+    assert(history.estimate(BuildHistory::kindLibrary, "/lib") == 1000 + 2 * BuildHistory::maxRecords - 1);
+    assert(history.estimate(BuildHistory::kindObject, "/a.cpp") == 0); // Dropped.
+    deleteFile(path);
+}
+
+
+void testTimeReport() {
+    char path[maxPath];
+    snprintf(path, sizeof(path), "/tmp/cx.sanity.%d.time", int(getpid()));
+    TimeReport report;
+    // GCC: parse time is split by size, 1000 bytes of source, 3000 of header.
+    Blob gcc;
+    const char* gccText =
+        "Time variable                                   usr           sys          wall           GGC\n"
+        " phase parsing                      :   0.30 ( 75%)   0.10 ( 50%)   0.40 ( 67%)  1000k ( 50%)\n"
+        " template instantiation             :   0.10 ( 25%)   0.00 (  0%)   0.10 ( 17%)   100k (  5%)\n"
+        " TOTAL                              :   0.40          0.20          0.60          2000k\n";
+    gcc.add(gccText, strlen(gccText));
+    assert(gcc.save(path));
+    Dependencies deps;
+    deps.add(1000, "a.cpp");
+    deps.add(3000, "../inc/a.h");
+    assert(report.add("/u/", "a.cpp", path, deps));
+    assert(report.add("/v/", "b.cpp", path, deps));
+    assert(report.getHeaderCost("/inc/a.h") == 2 * 300000000);
+    assert(report.getHeaderCount("/inc/a.h") == 2);
+    assert(report.getHeaderCost("/u/a.cpp") == 0);
+    assert(report.getTemplateCost("/u/a.cpp") == 100000000);
+    // Clang: per header and per template events, microseconds.
+    TimeReport clang;
+    Blob json;
+    const char* jsonText =
+        "{\"traceEvents\":[\n"
+        "{\"pid\":1,\"tid\":1,\"ph\":\"X\",\"ts\":0,\"dur\":5000,\"name\":\"Source\",\"args\":{\"detail\":\"/inc/b.h\"}},\n"
+        "{\"pid\":1,\"tid\":1,\"ph\":\"X\",\"ts\":0,\"dur\":700,\"name\":\"InstantiateClass\",\"args\":{\"detail\":\"std::vector<int, {}>\"}},\n"
+        "{\"pid\":1,\"tid\":1,\"ph\":\"X\",\"ts\":0,\"dur\":9000,\"name\":\"Total ExecuteCompiler\",\"args\":{\"count\":1}}\n"
+        "],\"beginningOfTime\":0}\n";
+    json.add(jsonText, strlen(jsonText));
+    assert(json.save(path));
+    assert(clang.add("/u/", "a.cpp", path, deps));
+    assert(clang.getHeaderCost("/inc/b.h") == 5000000);
+    assert(clang.getHeaderCount("/inc/b.h") == 1);
+    assert(clang.getTemplateCost("std::vector<int, {}>") == 700000);
+    deleteFile(path);
+    assert(!clang.add("/u/", "a.cpp", path, deps));
+}
+
+
+void testImpact() {
+    ImpactReport report;
+    // Program in /p/ includes a header of library unit /l/, whose object includes it too.
+    Dependencies main;
+    main.add(0, "main.cpp");
+    main.add(0, "../l/l.h");
+    main.add(0, "p.h");
+    Dependencies lib;
+    lib.add(0, "l.cpp");
+    lib.add(0, "l.h");
+    report.addObject("/p/", main, 100, true, 50);
+    report.addObject("/l/", lib, 30, false, 0);
+    report.addLibrary("/l/", 7);
+    assert(report.getHeaderCount("/l/l.h") == 2);
+    assert(report.getHeaderCost("/l/l.h") == 100 + 30 + 7 + 50); // Relinked once.
+    assert(report.getHeaderCost("/p/p.h") == 100 + 50);
+    assert(report.getHeaderCost("/p/main.cpp") == 0);
+    assert(report.getCoupling("/p/", "/l/") == 1);
+    assert(report.getCoupling("/l/", "/p/") == 0);
+}
+
+
+void testBench() {
+    int64_t a[10], b[10];
+    for (int i = 0; i < 10; i++) {
+        a[i] = 1000 + i;
+        b[i] = 2000 + i;
+    }
+    assert(BenchResults::getPValue(a, 10, a, 10) > 0.9);
+    assert(BenchResults::getPValue(a, 10, b, 10) < 0.001);
+    assert(BenchResults::getPValue(b, 10, a, 10) < 0.001);
+    int64_t same[4] = {5, 5, 5, 5};
+    assert(BenchResults::getPValue(same, 4, same, 4) == 1); // All tied.
+    double separated = BenchResults::getPValue(a, 10, b, 10);
+    b[0] = 1005; // Overlap makes it less certain.
+    assert(BenchResults::getPValue(a, 10, b, 10) > separated);
+    char path[maxPath];
+    snprintf(path, sizeof(path), "/tmp/cx.sanity.%d.bench", int(getpid()));
+    deleteFile(path);
+    BenchResults results;
+    assert(!results.load(path));
+    results.add(100, 90);
+    results.add(200, 180);
+    assert(results.save(path));
+    BenchResults loaded;
+    assert(loaded.load(path));
+    assert(loaded.getCount() == 2);
+    deleteFile(path);
+}
+
+
+void testFileLock() {
+    char path[maxPath];
+    snprintf(path, sizeof(path), "/tmp/cx.sanity.%d.lock", int(getpid()));
+    std::atomic<bool> locked(false);
+    std::thread* other;
+    {
+        FileLock lock(path);
+        other = new std::thread([&]() {
+            FileLock lock(path);
+            locked = true;
+        });
+        usleep(50 * 1000);
+        assert(!locked);
+    }
+    other->join();
+    delete other;
+    assert(locked);
+    deleteFile(path);
+}
+
+
 void testBatch() {
     {
         Batch batch;
@@ -227,6 +444,88 @@ void testBatch() {
 }
 
 
+struct SleepJob: public Job {
+    bool ok = true;
+    std::atomic<bool>& started;
+    SleepJob(std::atomic<bool>& s): started(s) { jobInstanceCount++; }
+    ~SleepJob() { jobInstanceCount--; }
+    void run() override {
+        started = true;
+        Runner runner;
+        runner.args.add("sleep");
+        runner.args.add("10");
+        ok = runner.run();
+    }
+};
+
+// Cancelled: pending jobs are dropped, running processes are killed.
+void testCancel() {
+    int savedMaxThreads = maxThreads;
+    maxThreads = 1;
+    {
+        Batch batch;
+        for (int i = 0; i < jobCount; i++) {
+            batch.send(new IncJob());
+        }
+        std::atomic<bool> started{false};
+        batch.send(new SleepJob(started)); // The newest is picked first.
+        while (!started) {
+            usleep(1000);
+        }
+        batch.cancel();
+        Runner::cancelAll();
+        SleepJob* job = (SleepJob*)(batch.receive());
+        assert(job && !job->ok);
+        delete job;
+        assert(!batch.receive());
+        Runner runner;
+        runner.args.add("true");
+        assert(!runner.run()); // Until resumed.
+        Runner::resume();
+        assert(runner.run() && runner.exitStatus == 0);
+    }
+    assert(jobInstanceCount == 0);
+    maxThreads = savedMaxThreads;
+}
+
+
+struct NestingJob: public Job {
+    int count = 0;
+    NestingJob() { jobInstanceCount++; }
+    ~NestingJob() { jobInstanceCount--; }
+    void run() override {
+        Batch batch;
+        for (int i = 0; i < jobCount; i++) {
+            batch.send(new IncJob());
+        }
+        while (IncJob* job = (IncJob*)(batch.receive())) {
+            count += job->count;
+            delete job;
+        }
+    }
+};
+
+// Jobs waiting for their own jobs must not starve the pool, even a single thread one.
+void testNestedBatch() {
+    int savedMaxThreads = maxThreads;
+    maxThreads = 1;
+    {
+        Batch batch;
+        for (int i = 0; i < jobCount; i++) {
+            NestingJob* job = new NestingJob();
+            job->priority = (i & 1) ? Job::priorityHigh : Job::priorityNormal;
+            batch.send(job);
+        }
+        while (NestingJob* job = (NestingJob*)(batch.receive())) {
+            assert(job->count == jobCount * 10);
+            delete job;
+        }
+    }
+    assert(jobInstanceCount == 0);
+    maxThreads = savedMaxThreads;
+}
+
+
 #define RUN(WHAT) do { \
     say(logLevelInfo, "Testing %s", #WHAT); \
     WHAT(); \
@@ -238,8 +537,17 @@ void test() {
     RUN(testFileStateList);
     RUN(testFileStateDict);
     RUN(testFileType);
+    RUN(testGccDeps);
     RUN(testConfig);
+    RUN(testHash);
+    RUN(testHistory);
+    RUN(testTimeReport);
+    RUN(testImpact);
+    RUN(testBench);
+    RUN(testFileLock);
     RUN(testBatch);
+    RUN(testNestedBatch);
+    RUN(testCancel);
 }
 
 
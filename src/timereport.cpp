@@ -0,0 +1,302 @@
+#include "timereport.h"
+#include "compiler.h"
+#include "dirs.h"
+#include "output.h"
+#include "history.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+// Report only, STL is hidden here.
+#include <vector>
+#include <algorithm>
+
+
+bool TimeReport::add(const char* unitPath, const char* sourcePath, const char* reportPath, const Dependencies& deps) {
+    Blob text;
+    if (!text.load(reportPath)) {
+        return false;
+    }
+    text.add("", 1);
+    char* p = text.data;
+    while (*p == ' ' || *p == '\n') {
+        p++;
+    }
+    sourceCount++;
+    if (*p == '{') {
+        perTemplate = true;
+        addClang(unitPath, p);
+    }
+    else {
+        addGcc(unitPath, sourcePath, p, deps);
+    }
+    return true;
+}
+
+
+void TimeReport::addHeader(const char* unitPath, const char* path, int length, int64_t cost) {
+    char absPath[maxPath];
+    if (length <= 0 || length >= maxPath) {
+        return;
+    }
+    rebasePath(unitPath, path, length, absPath);
+    FileStateDict::Entry* e;
+    headerCost.add(0, absPath, e);
+    e->tag += cost;
+    headerCount.add(0, absPath, e);
+    e->tag++;
+}
+
+
+// Wall time of a line of -ftime-report table, like
+// " phase parsing      :   0.99 ( 30%)   0.45 ( 50%)   1.48 ( 35%)    75M ( 39%)"
+// or, with older versions,
+// " phase parsing      :   0.99 (30%) usr   0.45 (50%) sys   1.48 (35%) wall   75M (39%) ggc".
+static bool parseGccTime(const char* line, const char* name, int64_t& time) {
+    int length = strlen(name);
+    while (*line == ' ') {
+        line++;
+    }
+    if (strncmp(line, name, length) != 0) {
+        return false;
+    }
+    line += length;
+    while (*line == ' ') {
+        line++;
+    }
+    if (*line != ':') {
+        return false;
+    }
+    line++;
+    double usr, sys, wall;
+    if (sscanf(line, " %lf ( %*d%%) %lf ( %*d%%) %lf", &usr, &sys, &wall) == 3 ||
+        sscanf(line, " %lf (%*d%%) usr %lf (%*d%%) sys %lf", &usr, &sys, &wall) == 3 ||
+        sscanf(line, " %lf %lf %lf", &usr, &sys, &wall) == 3)
+    {
+        time = int64_t(wall * 1e9);
+        return true;
+    }
+    return false;
+}
+
+
+void TimeReport::addGcc(const char* unitPath, const char* sourcePath, char* text, const Dependencies& deps) {
+    int64_t parsing = 0;
+    int64_t templates = 0;
+    int64_t total = 0;
+    for (char* line = text; *line; ) {
+        char* end = strchr(line, '\n');
+        if (end) {
+            *end = 0;
+        }
+        int64_t time;
+        if (parseGccTime(line, "phase parsing", time)) {
+            parsing += time;
+        }
+        else if (parseGccTime(line, "template instantiation", time)) {
+            templates += time;
+        }
+        else if (parseGccTime(line, "TOTAL", time)) {
+            total += time;
+        }
+        if (!end) {
+            break;
+        }
+        line = end + 1;
+    }
+    totalTime += total;
+    parseTime += parsing;
+    templateTime += templates;
+    // Split parse time by size. Sizes are the low half of dependency tags.
+    uint64_t size = 0;
+    for (Dependencies::Iterator i(deps); i; i.next()) {
+        size += i->tag & 0xFFFFFFFF;
+    }
+    if (size == 0) {
+        return;
+    }
+    for (Dependencies::Iterator i(deps); i; i.next()) {
+        FileType type = getFileType(i->string);
+        if (type != typeCSource && type != typeCppSource) {
+            addHeader(unitPath, i->string, i->length, int64_t(double(parsing) * (i->tag & 0xFFFFFFFF) / size));
+        }
+    }
+    if (templates) {
+        char absPath[maxPath];
+        FileStateDict::Entry* e;
+        templateCost.add(0, rebasePath(unitPath, sourcePath, absPath), e);
+        e->tag += templates;
+    }
+}
+
+
+// Value of a string field of a JSON object, unescaped in place.
+// Clang writes one event per object, without nested arrays.
+static bool getJsonString(char* begin, char* end, const char* key, char*& value, int& length) {
+    int keyLength = strlen(key);
+    for (char* p = begin; p + keyLength + 3 < end; p++) {
+        if (p[0] == '"' && strncmp(p + 1, key, keyLength) == 0 && p[keyLength + 1] == '"') {
+            p += keyLength + 2;
+            while (*p == ' ' || *p == ':') {
+                p++;
+            }
+            if (*p != '"') {
+                return false;
+            }
+            value = ++p;
+            char* out = p;
+            while (p < end && *p != '"') {
+                if (*p == '\\' && p + 1 < end) {
+                    p++;
+                }
+                *out++ = *p++;
+            }
+            length = out - value;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool getJsonNumber(char* begin, char* end, const char* key, int64_t& value) {
+    int keyLength = strlen(key);
+    for (char* p = begin; p + keyLength + 3 < end; p++) {
+        if (p[0] == '"' && strncmp(p + 1, key, keyLength) == 0 && p[keyLength + 1] == '"') {
+            p += keyLength + 2;
+            while (*p == ' ' || *p == ':') {
+                p++;
+            }
+            value = strtoll(p, nullptr, 10);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void TimeReport::addClang(const char* unitPath, char* text) {
+    // Events are the innermost objects: {"ph":"X",...,"dur":N,"name":"...","args":{"detail":"..."}}
+    // Find each event's end, then its start, ignoring braces in strings.
+    char* eventStart = nullptr;
+    int depth = 0;
+    for (char* p = text; *p; p++) {
+        if (*p == '"') {
+            for (p++; *p && *p != '"'; p++) {
+                if (*p == '\\' && p[1]) {
+                    p++;
+                }
+            }
+            if (!*p) {
+                break;
+            }
+            continue;
+        }
+        if (*p == '{') {
+            depth++;
+            if (depth == 2) {
+                eventStart = p;
+            }
+        }
+        else if (*p == '}') {
+            if (depth == 2 && eventStart) {
+                char* end = p;
+                char* name;
+                int nameLength;
+                int64_t duration;
+                if (getJsonString(eventStart, end, "name", name, nameLength) && getJsonNumber(eventStart, end, "dur", duration)) {
+                    duration *= 1000; // Microseconds.
+                    char* detail;
+                    int detailLength;
+                    bool hasDetail = getJsonString(eventStart, end, "detail", detail, detailLength);
+                    #define IS(WHAT) (nameLength == sizeof(WHAT) - 1 && memcmp(name, WHAT, nameLength) == 0)
+                    if (IS("Source") && hasDetail) {
+                        addHeader(unitPath, detail, detailLength, duration);
+                    }
+                    else if ((IS("InstantiateClass") || IS("InstantiateFunction")) && hasDetail) {
+                        FileStateDict::Entry* e;
+                        templateCost.add(0, detail, detailLength, e);
+                        e->tag += duration;
+                        templateCount.add(0, detail, detailLength, e);
+                        e->tag++;
+                    }
+                    else if (IS("Total ExecuteCompiler")) {
+                        totalTime += duration;
+                    }
+                    else if (IS("Total Frontend")) {
+                        parseTime += duration;
+                    }
+                    else if (IS("Total InstantiateFunction") || IS("Total InstantiateClass")) {
+                        templateTime += duration;
+                    }
+                    #undef IS
+                }
+                eventStart = nullptr;
+            }
+            depth--;
+        }
+    }
+}
+
+
+int64_t TimeReport::getHeaderCost(const char* path) const {
+    const FileStateDict::Entry* e = headerCost.find(path);
+    return e ? int64_t(e->tag) : 0;
+}
+
+
+int TimeReport::getHeaderCount(const char* path) const {
+    const FileStateDict::Entry* e = headerCount.find(path);
+    return e ? int(e->tag) : 0;
+}
+
+
+int64_t TimeReport::getTemplateCost(const char* name) const {
+    const FileStateDict::Entry* e = templateCost.find(name);
+    return e ? int64_t(e->tag) : 0;
+}
+
+
+static void printTop(const FileStateDict& costs, const FileStateDict* counts, int top) {
+    std::vector<const FileStateDict::Entry*> entries;
+    for (FileStateDict::Iterator i(costs); i; i.next()) {
+        entries.push_back(i.operator->());
+    }
+    std::sort(entries.begin(), entries.end(), [](const FileStateDict::Entry* a, const FileStateDict::Entry* b) {
+        return a->tag > b->tag;
+    });
+    char text[32];
+    for (int i = 0; i < int(entries.size()) && i < top; i++) {
+        const FileStateDict::Entry* e = entries[i];
+        if (counts) {
+            const FileStateDict::Entry* count = counts->find(e->string, e->length);
+            INFO("  %10s  x%-5d %s", formatDuration(e->tag, text), count ? int(count->tag) : 0, e->string);
+        }
+        else {
+            INFO("  %10s  %s", formatDuration(e->tag, text), e->string);
+        }
+    }
+}
+
+
+void TimeReport::print(int top) const {
+    if (sourceCount == 0) {
+        INFO("No compile time reports, nothing was compiled with --time-report");
+        return;
+    }
+    char total[32];
+    char parsing[32];
+    char templates[32];
+    INFO("%sCompile time report of %d sources:%s total %s, parsing %s, template instantiation %s", em, sourceCount, noem,
+        formatDuration(totalTime, total), formatDuration(parseTime, parsing), formatDuration(templateTime, templates));
+    INFO("%sMost expensive headers (parse time x inclusions):%s", em, noem);
+    printTop(headerCost, &headerCount, top);
+    if (perTemplate) {
+        INFO("%sMost expensive template instantiations:%s", em, noem);
+        printTop(templateCost, &templateCount, top);
+    }
+    else if (!templateCost.isEmpty()) {
+        INFO("%sSources with most template instantiation time:%s", em, noem);
+        printTop(templateCost, nullptr, top);
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "lists.h"
+
+// Compile time profile of a whole build, aggregated from per-source reports
+// of the compiler (see --time-report): GCC's -ftime-report output, or Clang's
+// -ftime-trace JSON.
+//
+// Header cost is its parse time multiplied by the number of sources including
+// it. Clang reports parse time of each header (including headers it includes).
+// GCC only reports parse time of the whole source, so it is split among the
+// source and its headers by their sizes, as recorded in dependency lists.
+class TimeReport {
+public:
+    // Source compiled in 'unitPath'. Paths in dependencies are relative to it.
+    bool add(const char* unitPath, const char* sourcePath, const char* reportPath, const Dependencies&);
+    void print(int top) const;
+
+    // Exposed for testing. Times are in nanoseconds.
+    int64_t getHeaderCost(const char* path) const;
+    int getHeaderCount(const char* path) const;
+    int64_t getTemplateCost(const char* name) const;
+
+private:
+    int sourceCount = 0;
+    int64_t totalTime = 0;
+    int64_t parseTime = 0;
+    int64_t templateTime = 0;
+    bool perTemplate = false; // Clang. Otherwise, templateCost is per source.
+    FileStateDict headerCost;
+    FileStateDict headerCount;
+    FileStateDict templateCost;
+    FileStateDict templateCount;
+    void addGcc(const char* unitPath, const char* sourcePath, char* text, const Dependencies&);
+    void addClang(const char* unitPath, char* text);
+    void addHeader(const char* unitPath, const char* path, int length, int64_t cost);
+};
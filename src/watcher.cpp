@@ -0,0 +1,106 @@
+#include "watcher.h"
+#include "compiler.h"
+#include "output.h"
+
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+
+Watcher::Watcher() {
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        FAILURE("Failed to initialize inotify");
+    }
+}
+
+
+Watcher::~Watcher() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+
+bool Watcher::add(const char* dir) {
+    if (fd < 0) {
+        return false;
+    }
+    if (dirs.find(dir)) {
+        return true;
+    }
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB;
+    int wd = inotify_add_watch(fd, dir, mask);
+    if (wd < 0) {
+        TRACE("Cannot watch %s", dir);
+        return false;
+    }
+    TRACE("Watching %s", dir);
+    dirs.put(wd, dir);
+    return true;
+}
+
+
+static bool isInteresting(const char* name) {
+    if (name[0] == '.') {
+        return false;
+    }
+    return getFileType(name) != typeUnknown || strcmp(name, "cx.unit") == 0 || strcmp(name, "cx.top") == 0;
+}
+
+
+bool Watcher::readEvents(StringList& changed) {
+    alignas(struct inotify_event) char buffer[16 * 1024];
+    int n = read(fd, buffer, sizeof(buffer));
+    if (n < 0) {
+        return errno == EINTR || errno == EAGAIN;
+    }
+    for (char* p = buffer; p < buffer + n; ) {
+        struct inotify_event* event = (struct inotify_event*)p;
+        p += sizeof(struct inotify_event) + event->len;
+        if (!event->len || (event->mask & IN_ISDIR) || !isInteresting(event->name)) {
+            continue;
+        }
+        for (FileStateDict::Iterator i(dirs); i; i.next()) {
+            if (int(i->tag) == event->wd) {
+                char path[maxPath];
+                changed.add(catPath(i->string, event->name, path));
+                TRACE("Changed: %s", path);
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+
+bool Watcher::wait(int quietMs, StringList& changed) {
+    if (fd < 0) {
+        return false;
+    }
+    int count = changed.getCount();
+    int timeout = -1;
+    for (;;) {
+        struct pollfd p;
+        p.fd = fd;
+        p.events = POLLIN;
+        int n = poll(&p, 1, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            return true; // Quiet long enough.
+        }
+        if (!readEvents(changed)) {
+            return false;
+        }
+        if (changed.getCount() > count) {
+            timeout = quietMs;
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "lists.h"
+
+// Waits for changes of files in a set of directories (Linux inotify).
+// Only sources, headers, and cx.unit/cx.top files are of interest.
+class Watcher {
+public:
+    Watcher();
+    Watcher(const Watcher&) = delete;
+    Watcher& operator=(const Watcher&) = delete;
+    ~Watcher();
+    operator bool() const { return fd >= 0; }
+    bool add(const char* dir);
+    // Block until something changes, then until there are no more changes for
+    // quietMs milliseconds (editors tend to write files in several steps).
+    // Changed file paths are appended to 'changed'.
+    bool wait(int quietMs, StringList& changed);
+private:
+    int fd = -1;
+    FileStateDict dirs; // Tag is inotify watch descriptor.
+    bool readEvents(StringList& changed);
+};
@@ -0,0 +1,233 @@
+// Generates a synthetic source tree for measuring cx (see ../run_bench).
+//
+// Usage: cx generate OUT_DIR [--units=N] [--sources=N] [--depth=N] [--deps=N] [--includes=N] [--make] [--ninja]
+//
+// Layout:
+//   OUT_DIR/units/l<layer>/u<unit>/s<k>.cpp, h<k>.h
+//   OUT_DIR/prog/main.cpp
+// Units are spread over 'depth' layers. Each unit uses 'deps' units of the next
+// layer (unit fan-out), each source includes 'includes' more headers of its own
+// unit (header fan-in). The program uses all units of layer 0.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+struct Options {
+    const char* out = nullptr;
+    int units = 50;
+    int sources = 10;
+    int depth = 5;
+    int deps = 3;
+    int includes = 3;
+    bool make = false;
+    bool ninja = false;
+};
+
+static Options options;
+
+
+static bool intOption(const char* arg, const char* name, int& value) {
+    int len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') {
+        value = atoi(arg + len + 1);
+        return true;
+    }
+    return false;
+}
+
+
+static void usage() {
+    fprintf(stderr, "Usage: generate OUT_DIR [--units=N] [--sources=N] [--depth=N] [--deps=N] [--includes=N] [--make] [--ninja]\n");
+    exit(1);
+}
+
+
+static void makeDirs(const std::string& path) {
+    for (size_t i = 1; i <= path.size(); i++) {
+        if (i == path.size() || path[i] == '/') {
+            mkdir(path.substr(0, i).c_str(), 0777);
+        }
+    }
+}
+
+
+static void writeFile(const std::string& path, const std::string& text) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "Cannot write %s\n", path.c_str());
+        exit(1);
+    }
+    fwrite(text.data(), 1, text.size(), f);
+    fclose(f);
+}
+
+
+static int layerOf(int unit) {
+    return unit % options.depth;
+}
+
+
+static std::string unitDir(int unit) {
+    return "units/l" + std::to_string(layerOf(unit)) + "/u" + std::to_string(unit);
+}
+
+
+static std::string funcName(int unit, int source) {
+    return "f_" + std::to_string(unit) + "_" + std::to_string(source);
+}
+
+
+// Units of the next layer used by this unit.
+static std::vector<int> unitDeps(int unit) {
+    std::vector<int> result;
+    int layer = layerOf(unit);
+    if (layer + 1 >= options.depth) {
+        return result;
+    }
+    std::vector<int> candidates;
+    for (int u = 0; u < options.units; u++) {
+        if (layerOf(u) == layer + 1) {
+            candidates.push_back(u);
+        }
+    }
+    for (int i = 0; i < options.deps && i < int(candidates.size()); i++) {
+        result.push_back(candidates[(unit * 7 + i * 13) % candidates.size()]);
+    }
+    return result;
+}
+
+
+static void generateUnit(int unit) {
+    std::string dir = std::string(options.out) + "/" + unitDir(unit);
+    makeDirs(dir);
+    std::vector<int> deps = unitDeps(unit);
+    for (int k = 0; k < options.sources; k++) {
+        std::string name = funcName(unit, k);
+        writeFile(dir + "/h" + std::to_string(k) + ".h", "#pragma once\n\nint " + name + "(int);\n");
+        std::string text = "#include \"h" + std::to_string(k) + ".h\"\n";
+        std::string body;
+        for (int i = 1; i <= options.includes && i < options.sources; i++) {
+            int other = (k + i) % options.sources;
+            text += "#include \"h" + std::to_string(other) + ".h\"\n";
+        }
+        for (size_t i = 0; i < deps.size(); i++) {
+            int other = (k + i) % options.sources;
+            // Relative to common parent, as cx allows.
+            text += "#include \"l" + std::to_string(layerOf(deps[i])) + "/u" + std::to_string(deps[i]) + "/h" + std::to_string(other) + ".h\"\n";
+            body += "    x += " + funcName(deps[i], other) + "(x);\n";
+        }
+        text += "\nint " + name + "(int x) {\n" + body + "    return x + " + std::to_string(k) + ";\n}\n";
+        writeFile(dir + "/s" + std::to_string(k) + ".cpp", text);
+    }
+}
+
+
+static void generateProgram() {
+    std::string dir = std::string(options.out) + "/prog";
+    makeDirs(dir);
+    std::string text = "#include <cstdio>\n";
+    std::string body;
+    for (int u = 0; u < options.units; u++) {
+        if (layerOf(u) == 0) {
+            text += "#include \"" + unitDir(u) + "/h0.h\"\n";
+            body += "    x += " + funcName(u, 0) + "(x);\n";
+        }
+    }
+    text += "\nint main() {\n    int x = 1;\n" + body + "    printf(\"%d\\n\", x);\n    return 0;\n}\n";
+    writeFile(dir + "/main.cpp", text);
+}
+
+
+// Equivalent of what cx does, for comparison.
+static void generateMakefile() {
+    std::string text = "CXX ?= g++\nAR ?= ar\nCXXFLAGS ?= -O2\n\n";
+    std::string libs;
+    std::string rules;
+    for (int u = 0; u < options.units; u++) {
+        std::string dir = unitDir(u);
+        std::string objs;
+        for (int k = 0; k < options.sources; k++) {
+            std::string src = dir + "/s" + std::to_string(k) + ".cpp";
+            std::string obj = "build/" + dir + "/s" + std::to_string(k) + ".o";
+            objs += " " + obj;
+            rules += obj + ": " + src + "\n\t@mkdir -p $(dir $@)\n\t$(CXX) $(CXXFLAGS) -MMD -MP -Iunits -c $< -o $@\n";
+        }
+        std::string lib = "build/" + dir + "/library.a";
+        libs += " " + lib;
+        rules += lib + ":" + objs + "\n\trm -f $@ && $(AR) crs $@ $^\n";
+    }
+    text += "build/prog/main: build/prog/main.o" + libs + "\n\t$(CXX) -o $@ build/prog/main.o -Wl,--start-group" + libs + " -Wl,--end-group\n";
+    text += "build/prog/main.o: prog/main.cpp\n\t@mkdir -p $(dir $@)\n\t$(CXX) $(CXXFLAGS) -MMD -MP -I. -c $< -o $@\n";
+    text += rules;
+    text += "\n-include $(shell find build -name '*.d' 2>/dev/null)\n";
+    writeFile(std::string(options.out) + "/Makefile", text);
+}
+
+
+static void generateNinja() {
+    std::string text =
+        "cxx = g++\ncxxflags = -O2\n\n"
+        "rule cc\n  command = $cxx $cxxflags -MMD -MF $out.d $inc -c $in -o $out\n  depfile = $out.d\n  deps = gcc\n\n"
+        "rule ar\n  command = rm -f $out && ar crs $out $in\n\n"
+        "rule link\n  command = $cxx -o $out $in -Wl,--start-group $libs -Wl,--end-group\n\n";
+    std::string libs;
+    for (int u = 0; u < options.units; u++) {
+        std::string dir = unitDir(u);
+        std::string objs;
+        for (int k = 0; k < options.sources; k++) {
+            std::string obj = "build/" + dir + "/s" + std::to_string(k) + ".o";
+            objs += " " + obj;
+            text += "build " + obj + ": cc " + dir + "/s" + std::to_string(k) + ".cpp\n  inc = -Iunits\n";
+        }
+        std::string lib = "build/" + dir + "/library.a";
+        libs += " " + lib;
+        text += "build " + lib + ": ar" + objs + "\n";
+    }
+    text += "build build/prog/main.o: cc prog/main.cpp\n  inc = -I.\n";
+    text += "build build/prog/main: link build/prog/main.o |" + libs + "\n  libs =" + libs + "\n";
+    writeFile(std::string(options.out) + "/build.ninja", text);
+}
+
+
+int main(int argc, const char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (arg[0] != '-') {
+            options.out = arg;
+        }
+        else if (strcmp(arg, "--make") == 0) {
+            options.make = true;
+        }
+        else if (strcmp(arg, "--ninja") == 0) {
+            options.ninja = true;
+        }
+        else if (!(
+            intOption(arg, "--units", options.units) ||
+            intOption(arg, "--sources", options.sources) ||
+            intOption(arg, "--depth", options.depth) ||
+            intOption(arg, "--deps", options.deps) ||
+            intOption(arg, "--includes", options.includes)
+        )) {
+            usage();
+        }
+    }
+    if (!options.out || options.units < 1 || options.sources < 1 || options.depth < 1 || options.deps < 0 || options.includes < 0) {
+        usage();
+    }
+    for (int u = 0; u < options.units; u++) {
+        generateUnit(u);
+    }
+    generateProgram();
+    if (options.make) {
+        generateMakefile();
+    }
+    if (options.ninja) {
+        generateNinja();
+    }
+    printf("Generated %d units, %d sources in %s\n", options.units, options.units * options.sources + 1, options.out);
+    return 0;
+}
@@ -0,0 +1,63 @@
+// Runs a command, prints one line: wall, user and system seconds, and peak RSS
+// of the largest process in the tree, in KB. Output of the command goes to /dev/null.
+//
+// Usage: cx measure -- COMMAND [ARGS...]
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+static double seconds(const struct timeval& t) {
+    return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+
+int main(int argc, char* argv[]) {
+    int first = 1;
+    if (first < argc && strcmp(argv[first], "--") == 0) {
+        first++;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "Usage: measure -- COMMAND [ARGS...]\n");
+        return 1;
+    }
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, 1);
+            dup2(null, 2);
+            close(null);
+        }
+        execvp(argv[first], argv + first);
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        return 1;
+    }
+    double wall = now() - start;
+    struct rusage children;
+    getrusage(RUSAGE_CHILDREN, &children);
+    printf("%.3f %.3f %.3f %ld\n", wall, seconds(children.ru_utime), seconds(children.ru_stime), children.ru_maxrss);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
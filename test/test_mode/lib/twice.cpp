@@ -0,0 +1,3 @@
+#include "twice.h"
+
+int twice(int x) { return x * 2; }
@@ -0,0 +1,8 @@
+#include <stdio.h>
+#include <string.h>
+
+int main() {
+    char line[16] = {0};
+    FILE* f = fopen("data.txt", "r");
+    return f && fgets(line, sizeof(line), f) && strcmp(line, "OK\n") == 0 ? 0 : 1;
+}
@@ -0,0 +1,5 @@
+#include "lib/twice.h"
+
+int main() {
+    return twice(2) == 4 ? 0 : 1;
+}